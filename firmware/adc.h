@@ -0,0 +1,202 @@
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/adc.h>
+#include <hardware/irq.h>
+#endif
+
+// adc settings
+#define ADC_SAMPLE_RATE 8000    // conversions per second, shared round-robin by all inputs
+#define ADC_OVERSAMPLE 16       // conversions summed into one sample, adds 2 bits of resolution
+#define ADC_IIR_SHIFT 3         // smoothing, each sample moves the output 1/2^shift of the way
+#define ADC_HYSTERESIS 24       // in 14 bit units, published value only moves past this
+#define ADC_FIRST_PIN 26        // GPIO of ADC input 0
+#define MAX_ANALOGS 4
+
+#ifndef NUM_INCREMENTS
+#define NUM_INCREMENTS 25
+#endif
+
+
+/*
+ * ANALOGPIPELINE CLASS
+ * Samples all knobs in the background and publishes filtered, stable values. On the RP2040
+ * the ADC runs free in round-robin mode and its FIFO interrupt feeds the filters, so loop()
+ * never waits on a conversion. Per input: oversample, IIR low-pass, hysteresis.
+ */
+class AnalogPipeline {
+  public:
+    /**
+     * Construct a pipeline over the given analog pins
+     */
+    AnalogPipeline(
+      byte* pins, uint8_t n,
+      unsigned int numIncrements = NUM_INCREMENTS
+      ): nAnalogs(n), numIncrements(numIncrements), nextSlot(0), changedMask(0) {
+      // slots follow the ADC's round-robin order, which is ascending by input
+      for (uint8_t i = 0; i < nAnalogs; i++) { slotInput[i] = pins[i] - ADC_FIRST_PIN; }
+      for (uint8_t i = 1; i < nAnalogs; i++) {
+        for (uint8_t j = i; j > 0 && slotInput[j - 1] > slotInput[j]; j--) {
+          uint8_t t = slotInput[j]; slotInput[j] = slotInput[j - 1]; slotInput[j - 1] = t;
+        }
+      }
+      for (uint8_t i = 0; i < nAnalogs; i++) {
+        for (uint8_t s = 0; s < nAnalogs; s++) {
+          if (slotInput[s] == pins[i] - ADC_FIRST_PIN) { slotOf[i] = s; }
+        }
+      }
+      for (uint8_t s = 0; s < nAnalogs; s++) {
+        acc[s] = 0; count[s] = 0; iir[s] = 0; held[s] = 0; published[s] = 0; primed[s] = false;
+      }
+#ifdef DEBUG
+      changedHandler = changedp;
+#endif
+    }
+
+
+    // Public methods
+
+    /**
+     * Start the free-running conversions
+     */
+    void begin() {
+#ifdef ARDUINO_ARCH_RP2040
+      instance = this;
+      uint8_t mask = 0;
+      adc_init();
+      for (uint8_t s = 0; s < nAnalogs; s++) {
+        adc_gpio_init(ADC_FIRST_PIN + slotInput[s]);
+        mask |= 1 << slotInput[s];
+      }
+      adc_select_input(slotInput[0]);
+      adc_set_round_robin(mask);
+      adc_fifo_setup(true, false, 1, false, false);   // irq as soon as one sample is in
+      adc_set_clkdiv(48000000 / ADC_SAMPLE_RATE - 1);
+      irq_set_exclusive_handler(ADC_IRQ_FIFO, onFifo);
+      adc_irq_set_enabled(true);
+      irq_set_enabled(ADC_IRQ_FIFO, true);
+      adc_run(true);
+#endif
+    }
+
+    /**
+     * Fire the changed handler for inputs that moved since the last call
+     */
+    void update() {
+      if (!changedMask) { return; }
+      noInterrupts();
+      uint8_t changed = changedMask;
+      changedMask = 0;
+      interrupts();
+
+      if (!changedHandler) { return; }
+      for (uint8_t i = 0; i < nAnalogs; i++) {
+        if (changed & (1 << slotOf[i])) { changedHandler(*this, i); }
+      }
+    }
+
+    /**
+     * Stable 12 bit value of an input
+     */
+    uint16_t value(uint8_t id) { return published[slotOf[id]]; }
+
+    /**
+     * Value of an input quantized to numIncrements steps
+     */
+    uint16_t position(uint8_t id) { return ((uint32_t)published[slotOf[id]] * numIncrements) >> 12; }
+
+    void setChangedHandler(void (*aChangedHandler)(AnalogPipeline&, uint8_t)) {
+      changedHandler = aChangedHandler;
+    }
+
+#ifndef ARDUINO_ARCH_RP2040
+    /**
+     * Host backend: run recorded raw 12 bit conversions of one input through the filters
+     */
+    void feed(uint8_t id, const uint16_t* samples, unsigned int n) {
+      for (unsigned int k = 0; k < n; k++) { push(slotOf[id], samples[k]); }
+    }
+#endif
+
+
+    // Public variables
+    uint8_t nAnalogs;
+
+
+  private:
+    unsigned int numIncrements;
+    uint8_t slotInput[MAX_ANALOGS];     // ADC input of each round-robin slot
+    uint8_t slotOf[MAX_ANALOGS];        // slot of each user id
+    uint8_t nextSlot;
+
+    uint32_t acc[MAX_ANALOGS];          // oversampling sum
+    uint8_t count[MAX_ANALOGS];
+    int32_t iir[MAX_ANALOGS];           // 14 bit value << ADC_IIR_SHIFT
+    bool primed[MAX_ANALOGS];           // had its first sample
+    uint16_t held[MAX_ANALOGS];         // 14 bit value after hysteresis
+    volatile uint16_t published[MAX_ANALOGS];
+    volatile uint8_t changedMask;
+
+    void (*changedHandler)(AnalogPipeline&, uint8_t) = NULL;
+
+    /**
+     * Filter one raw conversion. Runs in the ADC interrupt.
+     */
+    void push(uint8_t slot, uint16_t raw) {
+      acc[slot] += raw;
+      if (++count[slot] < ADC_OVERSAMPLE) { return; }
+
+      int32_t x = acc[slot] >> 2;         // 16 x 12 bit -> 14 bit
+      acc[slot] = 0;
+      count[slot] = 0;
+
+      // the first sample starts the filter where the knob is instead of ramping up from 0
+      if (!primed[slot]) {
+        primed[slot] = true;
+        iir[slot] = x << ADC_IIR_SHIFT;
+        held[slot] = x;
+        published[slot] = x >> 2;
+        changedMask |= 1 << slot;
+        return;
+      }
+
+      iir[slot] += x - (iir[slot] >> ADC_IIR_SHIFT);
+      int32_t y = iir[slot] >> ADC_IIR_SHIFT;
+
+      if (y > held[slot] + ADC_HYSTERESIS || y < held[slot] - ADC_HYSTERESIS) {
+        held[slot] = y;
+        if (published[slot] != (y >> 2)) {
+          published[slot] = y >> 2;
+          changedMask |= 1 << slot;
+        }
+      }
+    }
+
+#ifdef ARDUINO_ARCH_RP2040
+    static AnalogPipeline* instance;
+
+    static void onFifo() {
+      AnalogPipeline* ap = instance;
+      // an overflow means a slot was skipped, restart the round-robin in step
+      if (adc_hw->fcs & ADC_FCS_OVER_BITS) {
+        adc_run(false);
+        adc_fifo_drain();
+        adc_hw->fcs |= ADC_FCS_OVER_BITS;
+        adc_select_input(ap->slotInput[0]);
+        ap->nextSlot = 0;
+        adc_run(true);
+        return;
+      }
+      while (!adc_fifo_is_empty()) {
+        ap->push(ap->nextSlot, adc_fifo_get());
+        if (++ap->nextSlot == ap->nAnalogs) { ap->nextSlot = 0; }
+      }
+    }
+#endif
+
+#ifdef DEBUG
+    static void changedp(AnalogPipeline& ap, uint8_t id) { Serial.print(id); Serial.print("A CHANGED: "); Serial.println(ap.position(id)); }
+#endif
+};
+
+#ifdef ARDUINO_ARCH_RP2040
+AnalogPipeline* AnalogPipeline::instance = NULL;
+#endif
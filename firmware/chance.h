@@ -0,0 +1,88 @@
+// chance settings
+#define CHANCE_ALWAYS 255       // step probabilities are out of 256, this one always fires
+#define DEFAULT_SEED 0x2545F491
+
+
+/**
+ * Xorshift32 random numbers. The same seed always gives the same sequence.
+ */
+class Xorshift32 {
+  public:
+    Xorshift32(): state(DEFAULT_SEED) {}
+
+    /**
+     * Seeds are mixed first, small ones would otherwise start with runs of small numbers.
+     */
+    void seed(uint32_t s) {
+      s = (s ^ (s >> 16)) * 0x45D9F3B;
+      s = (s ^ (s >> 16)) * 0x45D9F3B;
+      s ^= s >> 16;
+      state = s ? s : DEFAULT_SEED;
+    }
+
+    uint32_t next() {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return state;
+    }
+
+  private:
+    uint32_t state;
+};
+
+
+/**
+ * Per byte a < b of four packed bytes, as four bits. The subtraction is done per byte
+ * with the top bits kept out of the way, the borrow out of each byte is the result.
+ */
+inline uint32_t lessThan4(uint32_t a, uint32_t b) {
+  const uint32_t H = 0x80808080;
+  uint32_t diff = ((a | H) - (b & ~H)) ^ ((a ^ ~b) & H);
+  uint32_t borrow = ((~a & b) | (~(a ^ b) & diff)) & H;
+  return (((borrow >> 7) * 0x00204081) >> 21) & 0xF;
+}
+
+
+/*
+ * CHANCELANE CLASS
+ * Probability per step of a channel. Once a bar, roll() draws a whole bar's mask at once:
+ * each random word is compared against four packed step thresholds in one go.
+ */
+class ChanceLane {
+  public:
+    ChanceLane(): always(~0ull) {
+      for (uint8_t i = 0; i < 16; i++) { thresholds[i] = 0xFFFFFFFF; }
+    }
+
+    /**
+     * Set the chance of a step firing, out of 256. CHANCE_ALWAYS always fires.
+     */
+    void set(uint8_t step, uint8_t chance) {
+      uint8_t shift = (step & 3) * 8;
+      thresholds[step >> 2] = (thresholds[step >> 2] & ~(0xFFul << shift)) | ((uint32_t)chance << shift);
+      if (chance == CHANCE_ALWAYS) { always |= 1ull << step; }
+      else { always &= ~(1ull << step); }
+    }
+
+    uint8_t get(uint8_t step) { return thresholds[step >> 2] >> ((step & 3) * 8); }
+
+    void seed(uint32_t s) { rng.seed(s); }
+
+    /**
+     * Mask of the steps that fire this bar, step i in bit i.
+     */
+    uint64_t roll(uint8_t length) {
+      if (always == ~0ull) { return ~0ull; }
+      uint64_t mask = 0;
+      for (uint8_t k = 0; k * 4 < length; k++) {
+        mask |= (uint64_t)lessThan4(rng.next(), thresholds[k]) << (k * 4);
+      }
+      return mask | always;
+    }
+
+  private:
+    uint32_t thresholds[16];    // four steps per word, step 4k in the low byte
+    uint64_t always;
+    Xorshift32 rng;
+};
@@ -246,6 +246,7 @@ class EventEncoder {
 
     void begin() {
       enc.begin();
+      lastCount = enc.getCount();
     }
 
     void setEncoderHandler(void (*aEncoderHandler)(EventEncoder & e)) {
@@ -284,7 +285,7 @@ class EventEncoder {
     PioEncoder enc;
     unsigned long lastSample = 0;
     int delta = 2;
-    int lastCount;
+    int lastCount = 0;
     int change;
     unsigned int id;
     unsigned int sampleFrame = SAMPLE_FRAME;
@@ -307,7 +308,7 @@ class EncoderButtons {
     EncoderButtons(
       byte (*pins)[2], uint8_t n,
       unsigned int defaultState = IDLE
-      ): nEncoders(n) {
+      ): nEncoders(n), nButtons(0) {
       // initialize the encoders
       for (int i = 0; i < nEncoders; i++) { e.emplace_back(EventEncoder(pins[i][0])); }     // fill up an array
       init();                                                                                
@@ -351,7 +352,7 @@ class EncoderButtons {
       unsigned int idleTimeout = IDLE_TIMEOUT
       ) {
       // set configs
-      for (int i = 0; i < nEncoders; i++) {
+      for (int i = 0; i < nButtons; i++) {
         b[i].setLongClickDuration(longClickDuration);       // setting description above
         b[i].setMultiClickInterval(multiClickInterval);     // setting description above
         b[i].setIdleTimeout(idleTimeout);                   // setting description above
@@ -365,7 +366,7 @@ class EncoderButtons {
         for (int i = 0; i < nEncoders; i++) {
           e[i].begin();
           e[i].setUserId(i); 
-          b[i].setUserId(i); 
+          if (i < nButtons) { b[i].setUserId(i); }
   #ifdef DEBUG
           e[i].setEncoderHandler(penc);
           // b[i].setClickHandler(clicke);
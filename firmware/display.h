@@ -0,0 +1,204 @@
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/clocks.h>
+#endif
+
+// display settings
+#define MAX_LEDS 80
+#define LED_BIT_US 1.25         // WS2812 bit time at 800 kHz
+#define LED_LATCH_US 80         // low time that latches a frame
+
+// colors, GRB
+#define COLOR_STEP_OFF      0x000000
+#define COLOR_STEP_ON       0x101010
+#define COLOR_PLAYHEAD      0x001000
+#define COLOR_PLAYHEAD_ON   0x304000
+#define COLOR_CHANNEL       0x000008
+#define COLOR_MUTED         0x080000
+#define COLOR_SELECTED      0x000030
+#define COLOR_MUTED_SEL     0x100020
+
+
+#ifndef ARDUINO_ARCH_RP2040
+// Host backend: every pushed frame goes to hostFrameHandler along with how many pixels changed.
+void (*hostFrameHandler)(const uint32_t* pixels, uint8_t n, uint8_t changed) = NULL;
+#endif
+
+
+/*
+ * STEPDISPLAY CLASS
+ * Framebuffer for the step and channel LEDs (a WS2812 chain, step LEDs first). The sequencer
+ * only writes bit planes, which costs nothing; update() diffs them against what is shown,
+ * re-encodes only the changed pixels and hands the chain to DMA. Diffing walks the set bits
+ * of the change mask, so a 64 step page costs no more than a 16 step one.
+ */
+class StepDisplay {
+  public:
+    /**
+     * Construct a display with nSteps step LEDs followed by nChannels channel LEDs
+     */
+    StepDisplay(byte pin, uint8_t nSteps, uint8_t nChannels):
+      pin(pin), nSteps(nSteps), nChannels(nChannels), nLeds(nSteps + nChannels),
+      active(0), playhead(0), mutes(0), selected(0), page(0),
+      dirty(true), pushedAt(0) {
+      for (uint8_t i = 0; i < MAX_LEDS; i++) { pixels[i] = 0; }
+    }
+
+    void begin() {
+#ifdef ARDUINO_ARCH_RP2040
+      static const uint16_t ws2812Instructions[] = {
+        0x6221,   // out x, 1       side 0 [2]
+        0x1123,   // jmp !x, 3      side 1 [1]
+        0x1400,   // jmp 0          side 1 [4]
+        0xa442,   // nop            side 0 [4]
+      };
+      static const pio_program_t ws2812Program = { ws2812Instructions, 4, -1 };
+
+      pio = pio0;
+      sm = pio_claim_unused_sm(pio, true);
+      uint offset = pio_add_program(pio, &ws2812Program);
+      pio_gpio_init(pio, pin);
+      pio_sm_set_consecutive_pindirs(pio, sm, pin, 1, true);
+
+      pio_sm_config c = pio_get_default_sm_config();
+      sm_config_set_wrap(&c, offset, offset + 3);
+      sm_config_set_sideset(&c, 1, false, false);
+      sm_config_set_sideset_pins(&c, pin);
+      sm_config_set_out_shift(&c, false, true, 24);
+      sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+      sm_config_set_clkdiv(&c, clock_get_hz(clk_sys) / (800000.0f * 10));   // 10 cycles per bit
+      pio_sm_init(pio, sm, offset, &c);
+      pio_sm_set_enabled(pio, sm, true);
+
+      dma = dma_claim_unused_channel(true);
+      dma_channel_config dc = dma_channel_get_default_config(dma);
+      channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+      channel_config_set_read_increment(&dc, true);
+      channel_config_set_write_increment(&dc, false);
+      channel_config_set_dreq(&dc, pio_get_dreq(pio, sm, true));
+      dma_channel_configure(dma, &dc, &pio->txf[sm], pixels, nLeds, false);
+#endif
+    }
+
+
+    // Framebuffer, cheap to call from the sequencer
+
+    /**
+     * Show the steps of the selected channel, step i in bit i
+     */
+    void setSteps(uint64_t steps) { active = steps; }
+
+    void setPlayhead(uint8_t step) { playhead = 1ull << step; }
+
+    void setMutes(uint16_t muteMask) { mutes = muteMask; }
+
+    void selectChannel(uint8_t channel) { selected = channel; }
+
+    uint8_t getSelected() { return selected; }
+
+    /**
+     * Show steps page * nSteps and on
+     */
+    void setPage(uint8_t aPage) { page = aPage; }
+
+
+    /**
+     * Push whatever changed. Returns right away while the previous frame is still going out.
+     */
+    void update() {
+      if (busy()) { return; }
+
+      uint8_t offset = page * nSteps;
+      uint64_t window = nSteps >= 64 ? ~0ull : (1ull << nSteps) - 1;
+      uint64_t on = offset < 64 ? (active >> offset) & window : 0;
+      uint64_t head = offset < 64 ? (playhead >> offset) & window : 0;
+      uint16_t sel = 1 << selected;
+
+      uint64_t changedSteps = (on ^ shownOn) | (head ^ shownHead);
+      uint16_t changedChannels = (mutes ^ shownMutes) | (sel ^ shownSel);
+      if (dirty) {
+        changedSteps = window;
+        changedChannels = 0xFFFF;
+        dirty = false;
+      }
+      if (!changedSteps && !(changedChannels & ((1 << nChannels) - 1))) { return; }
+
+      static const uint32_t stepColors[] = { COLOR_STEP_OFF, COLOR_STEP_ON, COLOR_PLAYHEAD, COLOR_PLAYHEAD_ON };
+      static const uint32_t channelColors[] = { COLOR_CHANNEL, COLOR_MUTED, COLOR_SELECTED, COLOR_MUTED_SEL };
+      uint8_t changed = 0;
+
+      while (changedSteps) {
+        uint8_t i = __builtin_ctzll(changedSteps);
+        changedSteps &= changedSteps - 1;
+        pixels[i] = stepColors[((on >> i) & 1) | (((head >> i) & 1) << 1)] << 8;
+        changed++;
+      }
+      for (uint8_t i = 0; i < nChannels; i++) {
+        if (!(changedChannels & (1 << i))) { continue; }
+        pixels[nSteps + i] = channelColors[((mutes >> i) & 1) | (((sel >> i) & 1) << 1)] << 8;
+        changed++;
+      }
+
+      shownOn = on;
+      shownHead = head;
+      shownMutes = mutes;
+      shownSel = sel;
+      push(changed);
+    }
+
+    /**
+     * Redraw every pixel on the next update
+     */
+    void refresh() { dirty = true; }
+
+
+  private:
+    byte pin;
+    uint8_t nSteps;
+    uint8_t nChannels;
+    uint8_t nLeds;
+
+    // framebuffer
+    uint64_t active;
+    uint64_t playhead;
+    uint16_t mutes;
+    uint8_t selected;
+    uint8_t page;
+
+    // what the LEDs show
+    uint64_t shownOn = 0;
+    uint64_t shownHead = 0;
+    uint16_t shownMutes = 0;
+    uint16_t shownSel = 0;
+    bool dirty;
+
+    uint32_t pixels[MAX_LEDS];    // GRB << 8, as the PIO shifts them out
+    uint32_t pushedAt;
+
+#ifdef ARDUINO_ARCH_RP2040
+    PIO pio;
+    uint sm;
+    int dma;
+#endif
+
+    /**
+     * Still sending or latching the last frame
+     */
+    bool busy() {
+#ifdef ARDUINO_ARCH_RP2040
+      if (dma_channel_is_busy(dma)) { return true; }
+#endif
+      return micros() - pushedAt < (uint32_t)(nLeds * 24 * LED_BIT_US) + LED_LATCH_US;
+    }
+
+    void push(uint8_t changed) {
+      pushedAt = micros();
+#ifdef ARDUINO_ARCH_RP2040
+      dma_channel_transfer_from_buffer_now(dma, pixels, nLeds);
+      (void)changed;
+#else
+      if (hostFrameHandler) { hostFrameHandler(pixels, nLeds, changed); }
+#endif
+    }
+};
@@ -2,11 +2,14 @@
 
 #include "controls.h"
 #include "sequencer.h"
+#include "router.h"
+#include "adc.h"
+#include "display.h"
+#include "protocol.h"
 // #include "midi.h"
 // #include "euclidean.h"
 
-#define TX 14
-#define RX 28
+#define LED_PIN 22
 
 byte GENERALBTN_PINS[] = { 18, 21, 7};
 byte CHANNELBTN_PINS[] = { 5, 4, 3, 2, 1, 0 };
@@ -17,12 +20,19 @@ byte ENCODER_PINS[][2] = { {26, 27}, {16, 17} };
 Buttons generalBtns( GENERALBTN_PINS, 3 );
 Buttons channelBtns( CHANNELBTN_PINS, 6 );
 
-// Analogs seqKnobs( ANALOG_PINS, 2 );
+// AnalogPipeline seqKnobs( ANALOG_PINS, 2 );
 
 EncoderButtons seqKnobs( ENCODER_PINS, 2 );
 
 // Initialize sequencer
-// MIDISequencer seq(6);
+MIDISequencer seq(6);
+
+// Initialize outputs
+OutputRouter router(6);
+StepDisplay display( LED_PIN, 16, 6 );
+
+// Binary control over the USB serial
+ControlLink link( seq );
 
 
 /**
@@ -45,15 +55,15 @@ byte extClockSource = MIDI;
  * FEATURES
 */
 
-// void togglePlayState() {
-//   if (playState == PLAYING) {
-//     playState = STOPPED;
-//     seq.stop();
-//   } else {
-//     playState = PLAYING;
-//     seq.start();
-//   }
-// }
+void togglePlayState() {
+  if (playState == PLAYING) {
+    playState = STOPPED;
+    seq.stop();
+  } else {
+    playState = PLAYING;
+    seq.start();
+  }
+}
 
 void changeExtClockSource(byte src) {
   extClockSource = src;
@@ -71,30 +81,55 @@ void changeClockState(byte state) {
 //   seq.setLength(length);
 // }
 
-// void offsetLength(uint8_t offset) {
-//   seq.offsetLength(offset);
-// }
+void offsetLength(int8_t offset) {
+  seq.offsetLength(offset);
+}
+
 
+/**
+ * INPUT HANDLERS
+*/
 
-void beatH(uint8_t* pos, bool** allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum) {
-  // Send MIDI_CLOCK to external gears
+void playH(EventButton& eb) {
+  togglePlayState();
+}
+void muteH(EventButton& eb) {
+  seq.channels[eb.userId()].muteToggle();
+  uint16_t mutes = 0;
+  for (uint8_t i = 0; i < seq.nChannels; i++) { mutes |= seq.channels[i].isMuted() << i; }
+  display.setMutes(mutes);
+}
+void lengthH(EventEncoder& ee) {
+  offsetLength(ee.getChange());
+}
+
+
+void beatH(uint8_t* pos, uint64_t* allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum) {
+  uint8_t ch = display.getSelected();
+  display.setSteps(allSequences[ch]);
+  display.setPlayhead(pos[ch]);
   // Serial.println("tick");
 }
 void trigH(bool* allTrigs, uint8_t nChannels) {
-  // Send MIDI_CLOCK to external gears
-  for (int i = 0; i < nChannels; i++) {
-    // Serial.println(allTrigs[i]);
-  }
+  // outputs are fed ahead of time from the sequencer's timeline by the router
+}
+void __not_in_flash_func(clockH)() {
+  // Send MIDI_CLOCK to external gears, runs in the clock interrupt
+  router.sendClock();
+}
+void transportH(uint8_t status, uint16_t songPosition) {
+  if (status == MIDI_CONTINUE) { router.sendSongPosition(songPosition); }
+  router.sendTransport(status);
 }
 
 
 void setup() {
 
-  // Initialize serial communication at 31250 bits per second, the default MIDI serial speed communication:
-  // Serial1.setTX(TX);
-  // Serial1.setRX(RX);
-  // Serial1.begin(31250);
-  Serial.begin(31250);
+  // USB serial carries the control link (and DEBUG text), the baud rate means nothing over USB.
+  // DIN MIDI on Serial1 is set up by the router
+  Serial.begin(115200);
+  router.begin();
+  display.begin();
 
   // Set up inputs
   // encoders
@@ -105,11 +140,18 @@ void setup() {
   pinMode(28, INPUT_PULLUP);
 
   bool pattern[] = {true, false, true};
-  // seq.channels[0].changeSequence(pattern, 3);
-  // seq.setBeatHandler(beatH);
-  // seq.setTriggerHandler(trigH);
+  seq.channels[0].changeSequence(pattern, 3);
+  seq.setBeatHandler(beatH);
+  seq.setTriggerHandler(trigH);
+  seq.setClockHandler(clockH);
+  seq.setTransportHandler(transportH);
+  router.setTimeline(&seq.getTimeline());
   // seq.start();
 
+  generalBtns.b[0].setPressedHandler(playH);
+  for (uint8_t i = 0; i < channelBtns.nButtons; i++) { channelBtns.b[i].setPressedHandler(muteH); }
+  seqKnobs.e[0].setEncoderHandler(lengthH);
+
 }
 
 
@@ -118,9 +160,12 @@ void loop() {
   // Serial.println(digitalRead(7));
   // Serial.print("28: ");
   // Serial.println(digitalRead(28));
-  // seq.update();
-  // // update controls
+  seq.update();
+  // update controls
   channelBtns.update();
   generalBtns.update();
   seqKnobs.update();
+  link.update();
+  router.update();
+  display.update();
 }
@@ -1,4 +1,8 @@
-const int ERHYTHMS_TABLE[65][65] = {
+/**
+ * Euclidean rhythms, ERHYTHMS_TABLE[steps][pulses]. Generated in research/euclidean,
+ * the first step is the most significant of the steps bits.
+ */
+const uint64_t ERHYTHMS_TABLE[65][65] = {
   {0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0},
   {0b0, 0b1, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0},
   {0b0, 0b10, 0b11, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0, 0b0},
@@ -66,3 +70,25 @@ const int ERHYTHMS_TABLE[65][65] = {
   {0b0, 0b1000000000000000000000000000000000000000000000000000000000000000, 0b1000000000000000000000000000000010000000000000000000000000000000, 0b1000000000000000000001000000000000000000001000000000000000000000, 0b1000000000000000100000000000000010000000000000001000000000000000, 0b1000000000000100000000000010000000000001000000000000100000000000, 0b1000000000010000000000100000000010000000000100000000001000000000, 0b1000000001000000001000000001000000001000000001000000001000000000, 0b1000000010000000100000001000000010000000100000001000000010000000, 0b1000000100000010000001000000100000010000001000000100000010000000, 0b1000001000000100000100000010000010000010000001000001000000100000, 0b1000001000001000001000001000010000010000010000010000010000100000, 0b1000010000100000100001000010000010000100001000001000010000100000, 0b1000010000100001000010000100001000010000100001000010000100001000, 0b1000010001000010001000010001000010000100010000100010000100010000, 0b1000100010000100010001000100001000100010001000010001000100010000, 0b1000100010001000100010001000100010001000100010001000100010001000, 0b1000100010001001000100010001001000100010001001000100010001001000, 0b1000100100010010001001000100100010001001000100100010010001001000, 0b1001000100100100010010010001001000100100100010010010001001000100, 0b1001001001001000100100100100100010010010010010001001001001001000, 0b1001001001001001001001001001001001001001001001001001001001001000, 0b1001001001001001001001001001001010010010010010010010010010010010, 0b1001001001010010010010010100100100101001001001001010010010010100, 0b1001001010010010100100101001001010010010100100101001001010010010, 0b1001010010100101001001010010100101001010010010100101001010010100, 0b1010010100101001010010100101001010100101001010010100101001010010, 0b1010010101001010100101001010100101010010100101010010101001010010, 0b1010100101010010101010010101001010101001010100101010100101010010, 0b1010101001010101010010101010100101010101001010101010010101010100, 0b1010101010101001010101010101001010101010101010010101010101010010, 0b1010101010101010101010101010100101010101010101010101010101010010, 0b1010101010101010101010101010101010101010101010101010101010101010, 0b1010101010101010101010101010101101010101010101010101010101010110, 0b1010101010101011010101010101011010101010101010110101010101010110, 0b1010101011010101010110101010101101010101011010101010110101010101, 0b1010101101010110101010110101011010101011010101101010101101010110, 0b1010110101011010101101011010101101010110101101010110101011010110, 0b1010110101101011010110101101011010101101011010110101101011010110, 0b1011010110101101011011010110101101011010110110101101011010110101, 0b1011011010110110101101101011011010110110101101101011011010110110, 0b1011011011010110110110110101101101101011011011011010110110110101, 0b1011011011011011011011011011011010110110110110110110110110110110, 0b1101101101101101101101101101101101101101101101101101101101101101, 0b1101101101101101110110110110110111011011011011011101101101101101, 0b1101101110110110111011011011101101110110110111011011011101101110, 0b1101110110111011011101101110110111011101101110110111011011101101, 0b1101110111011101101110111011101101110111011101101110111011101101, 0b1110111011101110111011101110111011101110111011101110111011101110, 0b1110111011101111011101110111011110111011101110111101110111011101, 0b1110111101110111101110111101110111101111011101111011101111011101, 0b1110111101111011110111101111011110111101111011110111101111011110, 0b1111011110111101111101111011110111110111101111011111011110111101, 0b1111011111011111011111011111011110111110111110111110111110111101, 0b1111101111101111110111110111111011111011111011111101111101111110, 0b1111110111111011111101111110111111011111101111110111111011111101, 0b1111111011111110111111101111111011111110111111101111111011111110, 0b1111111101111111101111111101111111101111111101111111101111111101, 0b1111111110111111111101111111111011111111101111111111011111111110, 0b1111111111101111111111110111111111111011111111111101111111111110, 0b1111111111111110111111111111111011111111111111101111111111111110, 0b1111111111111111111101111111111111111111101111111111111111111101, 0b1111111111111111111111111111111011111111111111111111111111111110, 0b1111111111111111111111111111111111111111111111111111111111111110, 0b1111111111111111111111111111111111111111111111111111111111111111},
 };
 
+
+/**
+ * Euclidean rhythm as a packed step mask with step i in bit i, started rotation steps in.
+ */
+inline uint64_t euclideanMask(uint8_t steps, uint8_t pulses, uint8_t rotation = 0) {
+  if (steps == 0 || steps > 64) { return 0; }
+  if (pulses > steps) { pulses = steps; }
+
+  // reverse the table's step order
+  uint64_t row = ERHYTHMS_TABLE[steps][pulses];
+  uint64_t mask = 0;
+  for (uint8_t i = 0; i < steps; i++) {
+    if (row & (1ull << (steps - 1 - i))) { mask |= 1ull << i; }
+  }
+
+  rotation %= steps;
+  if (rotation) {
+    uint64_t all = steps == 64 ? ~0ull : (1ull << steps) - 1;
+    mask = ((mask >> rotation) | (mask << (steps - rotation))) & all;
+  }
+  return mask;
+}
@@ -0,0 +1,464 @@
+// control link settings
+#define LINK_VERSION 1
+#define LINK_MAX_PAYLOAD 200        // bytes after cmd and tag, a full 16 channel state fits
+#define LINK_MAX_FRAME (LINK_MAX_PAYLOAD + 4)
+#define LINK_RX_BURST 256           // bytes parsed per update(), bounds the time spent in loop()
+#define PRESET_SLOTS 16
+
+// commands, replies are the command | LINK_REPLY with the same tag
+#define LINK_PING 0x01              // -> version, max channels, max length, preset slots
+#define LINK_GET_STATE 0x10         // -> state
+#define LINK_SET_STATE 0x11         // state ->
+#define LINK_GET_CHANCE 0x12        // channel -> channel, 64 step chances
+#define LINK_SET_CHANCE 0x13        // channel, first step, chances ->
+#define LINK_GET_LANES 0x14         // channel -> channel, lanes
+#define LINK_SET_LANES 0x15         // channel, lanes ->
+#define LINK_GET_PARAM 0x20         // param, channel, step -> param, channel, step, value
+#define LINK_SET_PARAM 0x21         // param, channel, step, value ->
+#define LINK_TRANSPORT 0x30         // MIDI_START, MIDI_STOP or MIDI_CONTINUE ->
+#define LINK_PUT_PRESET 0x40        // slot, scene ->
+#define LINK_GET_PRESET 0x41        // slot -> slot, scene
+#define LINK_PLAY_PRESETS 0x42      // first slot, count -> ; count 0 stops the song
+#define LINK_REPLY 0x80
+#define LINK_ERROR 0xFF             // -> command, error
+
+// errors
+#define LINK_ERR_CRC 1
+#define LINK_ERR_FRAME 2
+#define LINK_ERR_COMMAND 3
+#define LINK_ERR_LENGTH 4
+#define LINK_ERR_RANGE 5
+
+// parameters, values are 16 bit
+#define PARAM_TEMPO 0               // BPM * 100
+#define PARAM_LENGTH 1              // steps of a channel
+#define PARAM_MUTE 2                // of a channel
+#define PARAM_CHANCE 3              // of a channel's step, out of 256
+#define PARAM_LOOKAHEAD 4           // steps
+#define PARAM_SCENE 5               // read only
+#define PARAM_LEVEL 6               // of a channel's step, 0 to MAX_LEVEL
+#define PARAM_VELOCITY 7            // of a channel's plain steps
+#define PARAM_ACCENT_VELOCITY 8     // of a channel's accented steps
+#define PARAM_ACCENTS 9             // euclidean accent pulses of a channel, rotated by step
+
+#define STATE_HEADER 4              // tempo, playing, channels
+#define STATE_CHANNEL 10            // length, flags, sequence
+#define STATE_LANES (10 + MAX_SEQLENGTH / 2)   // velocity, accent velocity, accents, levels
+
+static_assert(sizeof(Scene) == 54, "presets go over the link as laid out in memory");
+
+
+#ifndef ARDUINO_ARCH_RP2040
+// Host backend: every encoded reply goes to hostLinkHandler instead of the USB serial.
+void (*hostLinkHandler)(const uint8_t* data, uint16_t n) = NULL;
+#endif
+
+
+/**
+ * CRC-16/CCITT-FALSE, a nibble at a time from a 16 entry table.
+ */
+inline uint16_t crc16(const uint8_t* data, uint16_t n, uint16_t crc = 0xFFFF) {
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  };
+  for (uint16_t i = 0; i < n; i++) {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+/**
+ * COBS encode n bytes into out, which takes n + n / 254 + 1 bytes. Returns the encoded
+ * length, without the 0 delimiter.
+ */
+inline uint16_t cobsEncode(const uint8_t* in, uint16_t n, uint8_t* out) {
+  uint16_t codeAt = 0;
+  uint16_t o = 1;
+  uint8_t code = 1;
+  for (uint16_t i = 0; i < n; i++) {
+    if (in[i]) {
+      out[o++] = in[i];
+      code++;
+    }
+    if (!in[i] || code == 0xFF) {
+      out[codeAt] = code;
+      codeAt = o++;
+      code = 1;
+    }
+  }
+  out[codeAt] = code;
+  return o;
+}
+
+
+/*
+ * CONTROLLINK CLASS
+ * Binary control of a sequencer over the USB serial. Frames are COBS encoded and end in 0:
+ * [command][tag][payload][crc16 lo][crc hi], the CRC covering command, tag and payload.
+ * Bytes are decoded as they arrive into one frame buffer, nothing is allocated. Replies
+ * start with a 0 too, so DEBUG text on the same port ends up in frames of its own that
+ * fail their CRC. Multi byte values are little endian.
+ */
+class ControlLink {
+  public:
+    ControlLink(MIDISequencer& seq): seq(seq), rxLength(0), left(0), pendingZero(false), overflow(false),
+      framesIn(0), errors(0) {
+      memset(bank, 0, sizeof(bank));
+    }
+
+    /**
+     * Parse what arrived on the USB serial
+     */
+    void update() {
+#ifdef ARDUINO_ARCH_RP2040
+      for (uint16_t n = 0; n < LINK_RX_BURST && Serial.available(); n++) { receive(Serial.read()); }
+#endif
+    }
+
+    /**
+     * Feed one received byte, a complete frame is handled right away
+     */
+    void receive(uint8_t b) {
+      if (b == 0) {
+        if (rxLength || left) { frame(); }
+        rxLength = 0; left = 0; pendingZero = false; overflow = false;
+        return;
+      }
+      if (left == 0) {
+        if (pendingZero) { put(0); }
+        left = b - 1;
+        pendingZero = b != 0xFF;
+      } else {
+        put(b);
+        left--;
+      }
+    }
+
+    void receive(const uint8_t* data, uint16_t n) {
+      for (uint16_t i = 0; i < n; i++) { receive(data[i]); }
+    }
+
+    /**
+     * Presets that LINK_PLAY_PRESETS plays as a song
+     */
+    Scene* getBank() { return bank; }
+
+    uint32_t getFrames() { return framesIn; }
+
+    uint32_t getErrors() { return errors; }
+
+
+  private:
+    MIDISequencer& seq;
+    Scene bank[PRESET_SLOTS];
+
+    uint8_t rx[LINK_MAX_FRAME];
+    uint16_t rxLength;
+    uint8_t left;               // bytes to the next COBS code
+    bool pendingZero;
+    bool overflow;
+
+    uint8_t reply[LINK_MAX_FRAME];
+    uint8_t tx[LINK_MAX_FRAME + LINK_MAX_FRAME / 254 + 2];
+
+    uint32_t framesIn;
+    uint32_t errors;
+
+    void put(uint8_t b) {
+      if (rxLength < LINK_MAX_FRAME) { rx[rxLength++] = b; }
+      else { overflow = true; }
+    }
+
+    /**
+     * Check and run a decoded frame
+     */
+    void frame() {
+      if (overflow || left || rxLength < 4) {
+        fail(0, 0, LINK_ERR_FRAME);
+        return;
+      }
+      uint16_t n = rxLength - 2;
+      if (crc16(rx, n) != (rx[n] | (rx[n + 1] << 8))) {
+        fail(0, 0, LINK_ERR_CRC);
+        return;
+      }
+      framesIn++;
+      run(rx[0], rx[1], rx + 2, n - 2);
+    }
+
+    void run(uint8_t cmd, uint8_t tag, const uint8_t* p, uint16_t n) {
+      uint8_t* r = reply + 2;
+      uint16_t rn = 0;
+
+      switch (cmd) {
+        case LINK_PING:
+          r[0] = LINK_VERSION; r[1] = seq.nChannels; r[2] = MAX_SEQLENGTH; r[3] = PRESET_SLOTS;
+          rn = 4;
+          break;
+
+        case LINK_GET_STATE:
+          rn = getState(r);
+          break;
+
+        case LINK_SET_STATE:
+          if (n < STATE_HEADER || n != STATE_HEADER + p[3] * STATE_CHANNEL) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[3] > seq.nChannels) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          for (uint8_t i = 0; i < p[3]; i++) {
+            if (!validLength(p[STATE_HEADER + i * STATE_CHANNEL])) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          }
+          setState(p);
+          break;
+
+        case LINK_GET_CHANCE:
+          if (n != 1) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= seq.nChannels) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          r[0] = p[0];
+          for (uint8_t s = 0; s < MAX_SEQLENGTH; s++) { r[1 + s] = seq.getChance(p[0], s); }
+          rn = 1 + MAX_SEQLENGTH;
+          break;
+
+        case LINK_SET_CHANCE:
+          if (n < 2) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= seq.nChannels || p[1] + n - 2 > MAX_SEQLENGTH) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          for (uint16_t s = 0; s < n - 2; s++) { seq.setChance(p[0], p[1] + s, p[2 + s]); }
+          break;
+
+        case LINK_GET_LANES:
+          if (n != 1) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= seq.nChannels) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          r[0] = p[0];
+          getLanes(p[0], r + 1);
+          rn = 1 + STATE_LANES;
+          break;
+
+        case LINK_SET_LANES:
+          if (n != 1 + STATE_LANES) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= seq.nChannels || p[1] > 127 || p[2] > 127) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          setLanes(p[0], p + 1);
+          break;
+
+        case LINK_GET_PARAM:
+          if (n != 3) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (!validParam(p[0], p[1], p[2])) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          memcpy(r, p, 3);
+          put16(r + 3, getParam(p[0], p[1], p[2]));
+          rn = 5;
+          break;
+
+        case LINK_SET_PARAM:
+          if (n != 5) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (!validParam(p[0], p[1], p[2]) || !setParam(p[0], p[1], p[2], get16(p + 3))) {
+            return fail(cmd, tag, LINK_ERR_RANGE);
+          }
+          break;
+
+        case LINK_TRANSPORT:
+          if (n != 1) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] == MIDI_START) { seq.start(); }
+          else if (p[0] == MIDI_STOP) { seq.stop(); }
+          else if (p[0] == MIDI_CONTINUE) { seq.resume(); }
+          else { return fail(cmd, tag, LINK_ERR_RANGE); }
+          break;
+
+        case LINK_PUT_PRESET:
+          if (n != 1 + sizeof(Scene)) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= PRESET_SLOTS || !putPreset(p[0], p + 1)) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          break;
+
+        case LINK_GET_PRESET:
+          if (n != 1) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] >= PRESET_SLOTS) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          r[0] = p[0];
+          memcpy(r + 1, &bank[p[0]], sizeof(Scene));
+          rn = 1 + sizeof(Scene);
+          break;
+
+        case LINK_PLAY_PRESETS:
+          if (n != 2) { return fail(cmd, tag, LINK_ERR_LENGTH); }
+          if (p[0] + p[1] > PRESET_SLOTS) { return fail(cmd, tag, LINK_ERR_RANGE); }
+          if (p[1]) { seq.playSong(bank + p[0], p[1]); }
+          else { seq.stopSong(); }
+          break;
+
+        default:
+          return fail(cmd, tag, LINK_ERR_COMMAND);
+      }
+      send(cmd | LINK_REPLY, tag, rn);
+    }
+
+    uint16_t getState(uint8_t* r) {
+      put16(r, tempo());
+      r[2] = seq.isPlaying();
+      r[3] = seq.nChannels;
+      uint8_t* c = r + STATE_HEADER;
+      for (uint8_t i = 0; i < seq.nChannels; i++, c += STATE_CHANNEL) {
+        uint64_t sequence = seq.channels[i].getSequence();
+        c[0] = seq.channels[i].getSequenceLength();
+        c[1] = seq.channels[i].isMuted();
+        for (uint8_t b = 0; b < 8; b++) { c[2 + b] = sequence >> (b * 8); }
+      }
+      return STATE_HEADER + seq.nChannels * STATE_CHANNEL;
+    }
+
+    /**
+     * Load a whole state. Takes effect from the first step no output has sent yet.
+     */
+    void setState(const uint8_t* p) {
+      uint16_t t = get16(p);
+      if (t) { seq.setTempo(t / 100.0f); }
+      const uint8_t* c = p + STATE_HEADER;
+      for (uint8_t i = 0; i < p[3]; i++, c += STATE_CHANNEL) {
+        uint64_t sequence = 0;
+        for (uint8_t b = 0; b < 8; b++) { sequence |= (uint64_t)c[2 + b] << (b * 8); }
+        seq.channels[i].changeSequence(sequence, c[0], c[0]);
+        seq.channels[i].setMuted(c[1] & 1);
+      }
+    }
+
+    /**
+     * A channel's dynamics: velocity, accent velocity, accent pattern, then the velocity lane
+     * packed as Channel keeps it.
+     */
+    void getLanes(uint8_t channel, uint8_t* r) {
+      Channel& ch = seq.channels[channel];
+      r[0] = ch.getVelocity();
+      r[1] = ch.getAccentVelocity();
+      uint64_t accents = ch.getAccents();
+      for (uint8_t b = 0; b < 8; b++) { r[2 + b] = accents >> (b * 8); }
+      memcpy(r + 10, ch.getLevels(), MAX_SEQLENGTH / 2);
+    }
+
+    void setLanes(uint8_t channel, const uint8_t* p) {
+      Channel& ch = seq.channels[channel];
+      ch.setVelocity(p[0], p[1]);
+      uint64_t accents = 0;
+      for (uint8_t b = 0; b < 8; b++) { accents |= (uint64_t)p[2 + b] << (b * 8); }
+      ch.changeAccents(accents);
+      ch.setLevels(p + 10);
+    }
+
+    bool validParam(uint8_t param, uint8_t channel, uint8_t step) {
+      switch (param) {
+        case PARAM_LENGTH:
+        case PARAM_MUTE:
+        case PARAM_VELOCITY:
+        case PARAM_ACCENT_VELOCITY: return channel < seq.nChannels;
+        case PARAM_CHANCE:
+        case PARAM_LEVEL:
+        case PARAM_ACCENTS: return channel < seq.nChannels && step < MAX_SEQLENGTH;
+        case PARAM_TEMPO:
+        case PARAM_LOOKAHEAD:
+        case PARAM_SCENE: return true;
+      }
+      return false;
+    }
+
+    uint16_t getParam(uint8_t param, uint8_t channel, uint8_t step) {
+      switch (param) {
+        case PARAM_TEMPO: return tempo();
+        case PARAM_LENGTH: return seq.channels[channel].getSequenceLength();
+        case PARAM_MUTE: return seq.channels[channel].isMuted();
+        case PARAM_CHANCE: return seq.getChance(channel, step);
+        case PARAM_LOOKAHEAD: return seq.getLookahead();
+        case PARAM_SCENE: return seq.getScene();
+        case PARAM_LEVEL: return seq.channels[channel].getLevel(step);
+        case PARAM_VELOCITY: return seq.channels[channel].getVelocity();
+        case PARAM_ACCENT_VELOCITY: return seq.channels[channel].getAccentVelocity();
+        case PARAM_ACCENTS: return __builtin_popcountll(seq.channels[channel].getAccents());
+      }
+      return 0;
+    }
+
+    bool setParam(uint8_t param, uint8_t channel, uint8_t step, uint16_t value) {
+      switch (param) {
+        case PARAM_TEMPO:
+          if (value < MIN_TEMPO * 100 || value > MAX_TEMPO * 100) { return false; }
+          seq.setTempo(value / 100.0f);
+          return true;
+        case PARAM_LENGTH:
+          if (!validLength(value)) { return false; }
+          seq.channels[channel].changeSequence(value);
+          return true;
+        case PARAM_MUTE:
+          seq.channels[channel].setMuted(value);
+          return true;
+        case PARAM_CHANCE:
+          if (value > CHANCE_ALWAYS) { return false; }
+          seq.setChance(channel, step, value);
+          return true;
+        case PARAM_LOOKAHEAD:
+          seq.setLookahead(value);
+          return true;
+        case PARAM_LEVEL:
+          if (value > MAX_LEVEL) { return false; }
+          seq.channels[channel].setLevel(step, value);
+          return true;
+        case PARAM_VELOCITY:
+          if (value > 127) { return false; }
+          seq.channels[channel].setVelocity(value, seq.channels[channel].getAccentVelocity());
+          return true;
+        case PARAM_ACCENT_VELOCITY:
+          if (value > 127) { return false; }
+          seq.channels[channel].setVelocity(seq.channels[channel].getVelocity(), value);
+          return true;
+        case PARAM_ACCENTS:
+          if (value > MAX_SEQLENGTH) { return false; }
+          seq.setAccents(channel, value, step);
+          return true;
+      }
+      return false;
+    }
+
+    /**
+     * Store a preset as it came over the link. Refuses lengths and tempos out of range,
+     * clamps pulses and rotation to the length.
+     */
+    bool putPreset(uint8_t slot, const uint8_t* p) {
+      Scene sc;
+      memcpy(&sc, p, sizeof(Scene));
+      if (sc.tempo && (sc.tempo < MIN_TEMPO * 100 || sc.tempo > MAX_TEMPO * 100)) { return false; }
+      for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+        SceneChannel& c = sc.channels[i];
+        if (!validLength(c.length)) { return false; }
+        if (c.pulses > c.length) { c.pulses = c.length; }
+        c.rotation %= c.length;
+      }
+      bank[slot] = sc;
+      return true;
+    }
+
+    bool validLength(uint16_t length) { return length >= 1 && length <= MAX_SEQLENGTH; }
+
+    uint16_t tempo() { return seq.getTempo() * 100 + 0.5f; }
+
+    void fail(uint8_t cmd, uint8_t tag, uint8_t error) {
+      errors++;
+      reply[2] = cmd;
+      reply[3] = error;
+      send(LINK_ERROR, tag, 2);
+    }
+
+    /**
+     * Frame and send the reply, whose payload is already in place after cmd and tag
+     */
+    void send(uint8_t cmd, uint8_t tag, uint16_t n) {
+      reply[0] = cmd;
+      reply[1] = tag;
+      uint16_t crc = crc16(reply, n + 2);
+      put16(reply + n + 2, crc);
+      tx[0] = 0;
+      uint16_t length = 1 + cobsEncode(reply, n + 4, tx + 1);
+      tx[length++] = 0;
+#ifdef ARDUINO_ARCH_RP2040
+      Serial.write(tx, length);
+#else
+      if (hostLinkHandler) { hostLinkHandler(tx, length); }
+#endif
+    }
+
+    static void put16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+
+    static uint16_t get16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+};
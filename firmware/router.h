@@ -0,0 +1,521 @@
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/uart.h>
+#include <hardware/gpio.h>
+#include "MIDIUSB.h"
+#endif
+
+// MIDI message definitions - based on MIDI 1.0 Standards. Clock and transport bytes come from sequencer.h
+#define MIDI_NOTE_ON  0x90
+#define MIDI_DRUM_CHANNEL 9     // channel 10 as reported to the user
+
+// destinations a channel can be routed to (bitmask)
+#define DEST_NONE 0x00
+#define DEST_DIN  0x01
+#define DEST_USB  0x02
+#define DEST_GATE 0x04
+
+// output ports, one queue each
+#define PORT_DIN  0
+#define PORT_USB  1
+#define PORT_GATE 2
+#define NUM_PORTS 3
+
+// router settings
+#define PORT_QUEUE_SIZE 64      // events per port queue, must be a power of two
+#define MIDI_BYTE_US 320        // one byte on the wire at 31250 baud (10 bits)
+#define NOTE_LENGTH_US 20000    // note off is sent this long after the note on
+#define GATE_LENGTH_US 5000     // gate outputs stay high this long
+#define USB_BURST 8             // max USB packets sent per update
+#define DEFAULT_NOTE 36         // channel 0 plays this note, the others count up from it
+#define NO_GATE 0xFF
+
+// Use pins 0/1, 12/13, 16/17 and 28/29. Crash otherwise
+#define MIDI_TX_PIN 12
+#define MIDI_RX_PIN 13
+
+
+/*
+ * PORT DRIVERS
+ * Non-blocking writes for each destination. The DIN port only takes a byte once the UART
+ * has sent the last one, so whatever is queued in software can still be reordered and a
+ * clock byte from the timer interrupt waits behind one byte at most.
+ */
+inline uint8_t messageLength(uint8_t status) {
+  if (status < 0xF0 || status == MIDI_SONG_POSITION) { return 3; }
+  return 1;
+}
+
+#ifdef ARDUINO_ARCH_RP2040
+#define MIDI_UART uart0
+
+inline void portsBegin() {
+  Serial1.setTX(MIDI_TX_PIN);
+  Serial1.setRX(MIDI_RX_PIN);
+  Serial1.begin(31250);
+}
+
+// an empty FIFO is not enough, the last byte may still be shifting out
+inline bool dinIdle() {
+  uint32_t fr = uart_get_hw(MIDI_UART)->fr;
+  return (fr & UART_UARTFR_TXFE_BITS) && !(fr & UART_UARTFR_BUSY_BITS);
+}
+inline void dinWrite(uint8_t b) { uart_get_hw(MIDI_UART)->dr = b; }
+
+inline void usbWrite(uint8_t status, uint8_t data1, uint8_t data2) {
+  // code index: realtime bytes are single byte packets, song position a three byte system common
+  uint8_t cin = status < 0xF0 ? status >> 4 : status == MIDI_SONG_POSITION ? 0x03 : 0x0F;
+  midiEventPacket_t packet = {cin, status, data1, data2};
+  MidiUSB.sendMIDI(packet);
+}
+inline void usbFlush() { MidiUSB.flush(); }
+
+inline void gateInit(uint8_t pin) { gpio_init(pin); gpio_set_dir(pin, GPIO_OUT); }
+inline void gateSet(uint32_t mask) { gpio_set_mask(mask); }
+inline void gateClear(uint32_t mask) { gpio_clr_mask(mask); }
+
+#else
+// Host backend: the DIN port behaves like a 31250 baud wire and every port reports
+// what it sends to hostOutputHandler, stamped with micros().
+void (*hostOutputHandler)(uint8_t port, const uint8_t* data, uint8_t len) = NULL;
+uint32_t hostDinBusyUntil = 0;
+
+inline void hostOutput(uint8_t port, const uint8_t* data, uint8_t len) {
+  if (hostOutputHandler) { hostOutputHandler(port, data, len); }
+}
+
+inline void portsBegin() {}
+
+inline bool dinIdle() { return (int32_t)(micros() - hostDinBusyUntil) >= 0; }
+inline void dinWrite(uint8_t b) {
+  hostDinBusyUntil = (dinIdle() ? micros() : hostDinBusyUntil) + MIDI_BYTE_US;
+  hostOutput(PORT_DIN, &b, 1);
+}
+
+inline void usbWrite(uint8_t status, uint8_t data1, uint8_t data2) {
+  uint8_t msg[] = { status, data1, data2 };
+  hostOutput(PORT_USB, msg, messageLength(status));
+}
+inline void usbFlush() {}
+
+inline void gateInit(uint8_t pin) {}
+inline void gateSet(uint32_t mask) { hostOutput(PORT_GATE, (const uint8_t*)&mask, 4); }
+inline void gateClear(uint32_t mask) { uint32_t off = 0; hostOutput(PORT_GATE, (const uint8_t*)&off, 4); }
+#endif
+
+
+/**
+ * Where a sequencer channel goes. Any mix of destinations can be enabled.
+ */
+struct Route {
+  uint8_t dests;          // DEST_* bitmask
+  uint8_t dinChannel;
+  uint8_t dinNote;
+  uint8_t usbChannel;
+  uint8_t usbNote;
+  uint8_t gatePin;        // NO_GATE if unused
+  uint8_t priority;       // higher goes out first on the DIN port
+};
+
+/**
+ * A queued MIDI message with the time its tick started.
+ */
+struct PortEvent {
+  uint8_t status;
+  uint8_t data1;
+  uint8_t data2;
+  uint32_t stamp;
+};
+
+/**
+ * Per-port counters. Smear is the time between a tick starting and the last of its
+ * events leaving the port.
+ */
+struct PortStats {
+  uint16_t backlog;       // events waiting in the queue
+  uint32_t tickSmear;     // smear of the most recent tick (us)
+  uint32_t worstSmear;    // worst smear since resetStats() (us)
+  uint16_t dropped;       // events lost to a full queue
+};
+
+
+/*
+ * PORTQUEUE CLASS
+ * Fixed size ring buffer, no allocation.
+ */
+class PortQueue {
+  public:
+    PortQueue(): head(0), tail(0) {}
+
+    bool push(const PortEvent& ev) {
+      if (size() == PORT_QUEUE_SIZE) { return false; }
+      q[tail++ & (PORT_QUEUE_SIZE - 1)] = ev;
+      return true;
+    }
+
+    PortEvent& front() { return q[head & (PORT_QUEUE_SIZE - 1)]; }
+    void pop() { head++; }
+    bool empty() { return head == tail; }
+    uint16_t size() { return (uint16_t)(tail - head); }
+
+  private:
+    PortEvent q[PORT_QUEUE_SIZE];
+    uint16_t head;
+    uint16_t tail;
+};
+
+
+/*
+ * OUTPUTROUTER CLASS
+ * Maps each sequencer channel to DIN-MIDI, USB-MIDI and gate outputs. Every port drains
+ * its own queue, so a busy DIN port never holds back USB or gate edges.
+ *
+ * Transport messages have their own queue per port that goes ahead of the notes. Clock
+ * bytes skip queues entirely, see sendClock().
+ */
+class OutputRouter {
+  public:
+    /**
+     * Construct a router with every channel on the drum channel of DIN and USB,
+     * one note per channel.
+     */
+    OutputRouter(uint8_t nChannels): nChannels(nChannels), timeline(NULL), dinQueue(NULL), dinByte(0), dinStatus(0),
+      gatesHigh(0), gateOffAt(0), usbClocks(0), clockWaits(0) {
+      for (uint8_t i = 0; i < MAX_ROUTES; i++) {
+        routes[i] = { DEST_DIN | DEST_USB, MIDI_DRUM_CHANNEL, (uint8_t)(DEFAULT_NOTE + i),
+                      MIDI_DRUM_CHANNEL, (uint8_t)(DEFAULT_NOTE + i), NO_GATE, (uint8_t)(MAX_ROUTES - i) };
+        offAt[PORT_DIN][i] = offAt[PORT_USB][i] = 0;
+        flatVelocity[i] = DEFAULT_VELOCITY;
+      }
+      offMask[PORT_DIN] = offMask[PORT_USB] = 0;
+      for (uint8_t p = 0; p < NUM_PORTS; p++) { latency[p] = 0; cursor[p] = 1; }
+      sortPriorities();
+      resetStats();
+    }
+
+    void begin() {
+      portsBegin();
+      for (uint8_t i = 0; i < nChannels; i++) {
+        if (routes[i].gatePin != NO_GATE) { gateInit(routes[i].gatePin); }
+      }
+    }
+
+    /**
+     * Route a channel. Gate pins set here are initialized on begin().
+     */
+    void setRoute(uint8_t channel, const Route& route) {
+      routes[channel] = route;
+      sortPriorities();
+    }
+
+    Route& getRoute(uint8_t channel) { return routes[channel]; }
+
+    /**
+     * Set the DIN send order of a channel within a tick. Higher goes first.
+     */
+    void setPriority(uint8_t channel, uint8_t priority) {
+      routes[channel].priority = priority;
+      sortPriorities();
+    }
+
+    /**
+     * Feed the ports from a sequencer timeline instead of trigger(). Each port reads
+     * its steps when they are due, shifted by its latency.
+     */
+    void setTimeline(Timeline* aTimeline) {
+      timeline = aTimeline;
+      epoch = timeline->getEpoch() - 1;
+    }
+
+    /**
+     * Set how late a port's destination sounds, in us. That port is fed this much earlier,
+     * at most as early as the sequencer's lookahead allows. Negative values delay it.
+     */
+    void setLatency(uint8_t port, int32_t us) {
+      latency[port] = us;
+    }
+
+    /**
+     * Queue the triggers of one tick on every port they are routed to.
+     */
+    void trigger(bool* allTrigs, uint8_t n) {
+      uint16_t trigs = 0;
+      for (uint8_t i = 0; i < n; i++) {
+        if (allTrigs[i]) { trigs |= 1 << i; }
+      }
+      uint32_t now = micros();
+      for (uint8_t p = 0; p < NUM_PORTS; p++) { triggerPort(p, trigs, flatVelocity, now); }
+    }
+
+    /**
+     * Send a MIDI clock byte. Meant for the clock's timer interrupt: the byte goes straight
+     * into the UART, which is allowed between the bytes of a message, so its latency only
+     * depends on whether a byte is already on the wire. USB picks it up on the next update.
+     */
+    void sendClock() {
+      if (!dinIdle()) { clockWaits++; }
+      dinWrite(MIDI_CLOCK);
+      usbClocks++;
+    }
+
+    /**
+     * Queue start, stop or continue on both MIDI ports.
+     */
+    void sendTransport(uint8_t status) {
+      uint32_t now = micros();
+      system[PORT_DIN].push({ status, 0, 0, now });
+      system[PORT_USB].push({ status, 0, 0, now });
+    }
+
+    /**
+     * Queue a song position pointer, in 16th notes, on both MIDI ports.
+     */
+    void sendSongPosition(uint16_t songPosition) {
+      PortEvent ev = { MIDI_SONG_POSITION, (uint8_t)(songPosition & 0x7F), (uint8_t)((songPosition >> 7) & 0x7F), (uint32_t)micros() };
+      system[PORT_DIN].push(ev);
+      system[PORT_USB].push(ev);
+    }
+
+    /**
+     * Clock bytes that had to wait for a byte already on the DIN wire, up to MIDI_BYTE_US.
+     */
+    uint32_t getClockWaits() { return clockWaits; }
+
+    /**
+     * Drain the port queues. Call it as often as possible from loop().
+     */
+    void update() {
+      uint32_t now = micros();
+
+      if (gatesHigh && (int32_t)(now - gateOffAt) >= 0) {
+        gateClear(gatesHigh);
+        gatesHigh = 0;
+      }
+
+      if (timeline) { readTimeline(now); }
+      sendOffs(PORT_DIN, now);
+      sendOffs(PORT_USB, now);
+      drainDin(now);
+      drainUsb(now);
+    }
+
+    PortStats getStats(uint8_t port) {
+      stats[port].backlog = port == PORT_GATE ? 0 : queues[port].size();
+      return stats[port];
+    }
+
+    void resetStats() {
+      for (uint8_t p = 0; p < NUM_PORTS; p++) {
+        stats[p] = { 0, 0, 0, 0 };
+        tickStamp[p] = 0;
+      }
+    }
+
+
+  private:
+    static const uint8_t MAX_ROUTES = 16;
+
+    uint8_t nChannels;
+    Route routes[MAX_ROUTES];
+    uint8_t order[MAX_ROUTES];                  // channels sorted by priority
+    uint8_t flatVelocity[MAX_ROUTES];           // for trigger(), which has no velocities
+    PortQueue queues[2];                        // DIN and USB, gates need no queue
+    PortQueue system[2];                        // transport, sent before notes
+    PortStats stats[NUM_PORTS];
+    uint32_t tickStamp[NUM_PORTS];
+
+    Timeline* timeline;
+    uint16_t epoch;                             // timeline epoch the cursors belong to
+    uint32_t cursor[NUM_PORTS];                 // next timeline step of each port
+    int32_t latency[NUM_PORTS];
+
+    uint16_t offMask[2];                        // channels waiting for a note off
+    uint32_t offAt[2][MAX_ROUTES];
+
+    PortQueue* dinQueue;                        // queue of the DIN message being sent
+    uint8_t dinByte;                            // next byte of that message
+    uint8_t dinStatus;                          // running status
+
+    uint32_t gatesHigh;
+    uint32_t gateOffAt;
+
+    volatile uint8_t usbClocks;                 // clock bytes waiting for USB
+    volatile uint32_t clockWaits;
+
+    /**
+     * Insertion sort, only runs when routes change.
+     */
+    void sortPriorities() {
+      for (uint8_t i = 0; i < MAX_ROUTES; i++) { order[i] = i; }
+      for (uint8_t i = 1; i < MAX_ROUTES; i++) {
+        uint8_t ch = order[i];
+        int8_t j = i - 1;
+        while (j >= 0 && routes[order[j]].priority < routes[ch].priority) {
+          order[j + 1] = order[j];
+          j--;
+        }
+        order[j + 1] = ch;
+      }
+    }
+
+    /**
+     * Send every timeline step that is due on a port. Nothing goes out while stopped.
+     */
+    void readTimeline(uint32_t now) {
+      if (timeline->getEpoch() != epoch) {
+        epoch = timeline->getEpoch();
+        for (uint8_t p = 0; p < NUM_PORTS; p++) { cursor[p] = timeline->getStart(); }
+      }
+      if (!timeline->isPlaying()) { return; }
+
+      for (uint8_t p = 0; p < NUM_PORTS; p++) {
+        if (cursor[p] < timeline->getStart()) { cursor[p] = timeline->getStart(); }
+        while (cursor[p] < timeline->getEnd()) {
+          uint32_t due = timeline->timeOf(cursor[p]) - latency[p];
+          if ((int32_t)(now - due) < 0) { break; }
+          timeline->freeze(cursor[p]);
+          triggerPort(p, timeline->at(cursor[p]), timeline->velocity(cursor[p]), due);
+          cursor[p]++;
+        }
+      }
+    }
+
+    /**
+     * Queue one tick's triggers on a port, highest priority first, each at its channel's
+     * velocity. Smear is measured from the stamp.
+     */
+    void triggerPort(uint8_t port, uint16_t trigs, const uint8_t* velocity, uint32_t stamp) {
+      if (!trigs) { return; }
+      uint32_t gates = 0;
+
+      for (uint8_t k = 0; k < MAX_ROUTES; k++) {
+        uint8_t ch = order[k];
+        if (ch >= nChannels || !(trigs & (1 << ch))) { continue; }
+        Route& r = routes[ch];
+
+        if (port == PORT_DIN && (r.dests & DEST_DIN)) {
+          enqueue(PORT_DIN, { (uint8_t)(MIDI_NOTE_ON | r.dinChannel), r.dinNote, velocity[ch], stamp });
+          scheduleOff(PORT_DIN, ch, stamp);
+        }
+        if (port == PORT_USB && (r.dests & DEST_USB)) {
+          enqueue(PORT_USB, { (uint8_t)(MIDI_NOTE_ON | r.usbChannel), r.usbNote, velocity[ch], stamp });
+          scheduleOff(PORT_USB, ch, stamp);
+        }
+        if (port == PORT_GATE && (r.dests & DEST_GATE) && r.gatePin != NO_GATE) {
+          gates |= 1ul << r.gatePin;
+        }
+      }
+
+      // all gate edges of a tick go out in a single register write
+      if (gates) {
+        gateSet(gates);
+        gatesHigh |= gates;
+        gateOffAt = stamp + GATE_LENGTH_US;
+      }
+    }
+
+    void enqueue(uint8_t port, const PortEvent& ev) {
+      if (!queues[port].push(ev)) { stats[port].dropped++; }
+    }
+
+    void scheduleOff(uint8_t port, uint8_t ch, uint32_t now) {
+      offMask[port] |= 1 << ch;
+      offAt[port][ch] = now + NOTE_LENGTH_US;
+    }
+
+    /**
+     * Note offs are sent as note ons with zero velocity to keep running status.
+     */
+    void sendOffs(uint8_t port, uint32_t now) {
+      if (!offMask[port]) { return; }
+      for (uint8_t ch = 0; ch < MAX_ROUTES; ch++) {
+        if (!(offMask[port] & (1 << ch)) || (int32_t)(now - offAt[port][ch]) < 0) { continue; }
+        Route& r = routes[ch];
+        if (port == PORT_DIN) {
+          enqueue(PORT_DIN, { (uint8_t)(MIDI_NOTE_ON | r.dinChannel), r.dinNote, 0, now });
+        } else {
+          enqueue(PORT_USB, { (uint8_t)(MIDI_NOTE_ON | r.usbChannel), r.usbNote, 0, now });
+        }
+        offMask[port] &= ~(1 << ch);
+      }
+    }
+
+    /**
+     * Feed the UART one byte at a time, only when its FIFO is empty. A new message is
+     * taken from the transport queue first.
+     */
+    void drainDin(uint32_t now) {
+      while (dinIdle()) {
+        if (dinByte == 0) {
+          if (!system[PORT_DIN].empty()) { dinQueue = &system[PORT_DIN]; }
+          else if (!queues[PORT_DIN].empty()) { dinQueue = &queues[PORT_DIN]; }
+          else { return; }
+        }
+        PortEvent& ev = dinQueue->front();
+        uint8_t len = messageLength(ev.status);
+
+        if (dinByte > 0) {
+          dinWrite(dinByte == 1 ? ev.data1 : ev.data2);
+          dinByte++;
+        } else if (ev.status == dinStatus) {
+          dinByte = 1;
+          continue;
+        } else {
+          dinWrite(ev.status);
+          // system common messages cancel running status, realtime ones leave it alone
+          if (ev.status < 0xF0) { dinStatus = ev.status; }
+          else if (ev.status < 0xF8) { dinStatus = 0; }
+          dinByte = 1;
+        }
+
+        if (dinByte == len) {
+          if (ev.status < 0xF0 && ev.data2) { countSent(PORT_DIN, now, ev.stamp); }
+          dinByte = 0;
+          dinQueue->pop();
+        }
+      }
+    }
+
+    void drainUsb(uint32_t now) {
+      uint8_t sent = 0;
+
+      if (usbClocks) {
+        noInterrupts();
+        uint8_t clocks = usbClocks;
+        usbClocks = 0;
+        interrupts();
+        for (; sent < clocks; sent++) { usbWrite(MIDI_CLOCK, 0, 0); }
+      }
+
+      PortQueue& sys = system[PORT_USB];
+      while (!sys.empty()) {
+        usbWrite(sys.front().status, sys.front().data1, sys.front().data2);
+        sys.pop();
+        sent++;
+      }
+
+      PortQueue& q = queues[PORT_USB];
+      for (uint8_t burst = 0; !q.empty() && burst < USB_BURST; burst++) {
+        PortEvent& ev = q.front();
+        usbWrite(ev.status, ev.data1, ev.data2);
+        if (ev.data2) { countSent(PORT_USB, now, ev.stamp); }
+        q.pop();
+        sent++;
+      }
+      if (sent) { usbFlush(); }
+    }
+
+    /**
+     * Update the smear of the tick a note on belongs to. The DIN port adds the time
+     * the last byte spends on the wire. Gates all switch at once and never smear.
+     */
+    void countSent(uint8_t port, uint32_t now, uint32_t stamp) {
+      uint32_t smear = now - stamp;
+      if (port == PORT_DIN) { smear += MIDI_BYTE_US; }
+      if (stamp != tickStamp[port]) {
+        tickStamp[port] = stamp;
+        stats[port].tickSmear = 0;
+      }
+      if (smear > stats[port].tickSmear) { stats[port].tickSmear = smear; }
+      if (smear > stats[port].worstSmear) { stats[port].worstSmear = smear; }
+    }
+};
@@ -1,85 +1,470 @@
-#include <AsyncTimer.h>
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/timer.h>
+#endif
 
 #include <vector>
 #include <functional>
 
+#include "euclidean.h"
+#include "chance.h"
+
 // MIDI clock, start and stop byte definitions - based on MIDI 1.0 Standards.
 #define MIDI_CLOCK 0xF8
 #define MIDI_START 0xFA
+#define MIDI_CONTINUE 0xFB
 #define MIDI_STOP  0xFC
+#define MIDI_SONG_POSITION 0xF2
 
 // sequence length
 #define DEFAULT_SEQLENGTH 16
-#define MAX_SEQLENGTH 16
+#define MAX_SEQLENGTH 64
 #define MAX_CHANNELS 16
 
 #define DEFAULT_TEMPO 120
 
+// velocity settings
+#define DEFAULT_VELOCITY 0x45
+#define DEFAULT_ACCENT_VELOCITY 0x70
+#define MAX_LEVEL 15            // velocity lane steps are 4 bit levels, this one plays the full velocity
+
 
 // TODO FIX 2D NON-STATIC ARRAY THING!!!!
 
 
+// tempo settings
+#define TEMPO_ONE 65536         // tempos are fixed point BPM with 16 fractional bits
+#define MIN_TEMPO 20
+#define MAX_TEMPO 300
+#define RAMP_LINEAR 0
+#define RAMP_EXPONENTIAL 1
+#define RAMP_ONE 4294967296.0   // exponential ramp ratios have 32 fractional bits
+#define RAMP_HALF (1ll << 31)
+
+// clock settings
+#define CLOCK_PPQN 24           // MIDI clock pulses per quarter note
+#define CLOCKS_PER_STEP 24      // pulses per sequencer step, 24 plays steps as quarters, 6 as 16ths
+#define CLOCKS_PER_SONG_POSITION 6  // song position pointer counts 16th notes
+
+#ifndef __not_in_flash_func
+#define __not_in_flash_func(f) f
+#endif
+
+
+/**
+ * Lateness of the clock pulses against their schedule, in us.
+ */
+struct ClockJitter {
+  int32_t minLate;
+  int32_t maxLate;
+  int32_t meanLate;
+  uint32_t count;
+};
+
+
 /**
  * MIDI clock generator. uClock by midilab seems like a great library to substitute this with.
  * Not available on some hardware yet. https://github.com/midilab/uClock/tree/main
+ *
+ * Pulses at CLOCK_PPQN are scheduled on micros() with the period kept in 1/256 us, so tempo
+ * has sub-BPM precision without drift. Tempo changes keep the phase of the running pulse
+ * and never reset the position.
+ *
+ * On the RP2040 every pulse is a hardware alarm interrupt. The pulse handler runs first
+ * thing in it, so the clock byte goes out with a constant latency; the sequencer steps
+ * are then picked up by update() from loop().
 */
 class Clock {
   public:
-    Clock(): bpm(120), beatn(0) {}
+    Clock(): tempo((uint32_t)DEFAULT_TEMPO * TEMPO_ONE), pulsen(0), handled(0), beatn(0),
+      running(false), rampTicks(0), measuring(false), jitter{ INT32_MAX, INT32_MIN, 0, 0 }, lateSum(0) {
+      period = periodOf(tempo);
+    }
 
+    /**
+     * Start from the top.
+     */
     void start() {
-      if (intervalId) {
-        stop();
+      stop();
+      pulsen = 0;
+      handled = 0;
+      beatn = 0;
+      resume();
+    }
+
+    /**
+     * Start again from the current position. The first pulse comes one period later.
+     */
+    void resume() {
+#ifdef ARDUINO_ARCH_RP2040
+      if (alarm < 0) {
+        instance = this;
+        alarm = hardware_alarm_claim_unused(true);
+        hardware_alarm_set_callback(alarm, onAlarm);
       }
-      intervalId = t.setInterval([this]() { beatn++; beatHandler(beatn); }, 60000 / bpm);
+#endif
+      noInterrupts();
+      nextTick = micros() + (period >> 8);
+      frac = period & 0xFF;
+      running = true;
+      arm();
+      interrupts();
     }
 
+    /**
+     * Stop, keeping the position for resume().
+     */
     void stop() {
-      beatn = 0;
-      t.cancelAll();
+      running = false;
+#ifdef ARDUINO_ARCH_RP2040
+      if (alarm >= 0) { hardware_alarm_cancel(alarm); }
+#endif
+    }
+
+    bool isRunning() {
+      return running;
+    }
+
+    /**
+     * Change tempo right away. The fraction of the current pulse already elapsed is kept.
+     */
+    void setTempo(float bpm) {
+      noInterrupts();
+      rampTicks = 0;
+      retime(toFixed(bpm));
+      interrupts();
+    }
+
+    /**
+     * Move to a new tempo over the given number of beats. The tempo is stepped once per
+     * pulse: linear adds a constant, exponential multiplies tempo and period by a constant.
+     * Both keep 32 fractional bits, so a ramp of a thousand beats still ends on its target.
+     */
+    void rampTempo(float bpm, uint16_t beats, uint8_t shape = RAMP_LINEAR) {
+      if (beats == 0) {
+        setTempo(bpm);
+        return;
+      }
+      uint32_t ticks = (uint32_t)beats * CLOCK_PPQN;
+      uint32_t target = toFixed(bpm);
+      noInterrupts();
+      rampTarget = target;
+      rampShape = shape;
+      if (shape == RAMP_EXPONENTIAL) {
+        double ratio = pow((double)target / tempo, 1.0 / ticks);
+        rampTempoMul = (int32_t)llround((ratio - 1) * RAMP_ONE);
+        rampPeriodMul = (int32_t)llround((1 / ratio - 1) * RAMP_ONE);
+      } else {
+        rampStep = (((int64_t)target - tempo) << 16) / (int32_t)ticks;
+      }
+      rampTicks = ticks;
+      interrupts();
+    }
+
+    float getTempo() {
+      return (float)tempo / TEMPO_ONE;
+    }
+
+    uint32_t getBeat() {
+      return beatn;
     }
 
-    // TODO FIX CRASHES THE STARTUP OF THE CHIP FOR SOME REASON
-    void setTempo(uint8_t bpm) {
-      this->bpm = bpm;
-      start();
+    /**
+     * Time of a beat, past or upcoming, extrapolated from the current tempo. Beat n falls
+     * on pulse (n - 1) * CLOCKS_PER_STEP + 1, which alignSongPosition() never moves.
+     */
+    uint32_t beatTime(uint32_t beat) {
+      noInterrupts();
+      int32_t pulses = (int32_t)((beat - 1) * CLOCKS_PER_STEP + 1 - pulsen - 1);
+      uint32_t t = nextTick + (uint32_t)(((int64_t)pulses * period + frac) >> 8);
+      interrupts();
+      return t;
     }
 
-    uint8_t getTempo() {
-      return bpm;
+    /**
+     * Round the position up to the next song position pointer boundary and return it.
+     * Only call while stopped. Steps fall on pulses right after a boundary, so none
+     * is skipped or played twice.
+     */
+    uint16_t alignSongPosition() {
+      uint32_t spp = (pulsen + CLOCKS_PER_SONG_POSITION - 1) / CLOCKS_PER_SONG_POSITION;
+      pulsen = handled = spp * CLOCKS_PER_SONG_POSITION;
+      return spp;
     }
 
-    void setBeatHandler(std::function<void(uint16_t)> aBeatHandler) {
+    void setBeatHandler(std::function<void(uint32_t)> aBeatHandler) {
       beatHandler = aBeatHandler;
     }
 
+    /**
+     * Set the function called on every pulse. It runs in the timer interrupt, keep it short.
+     */
+    void setPulseHandler(void (*aPulseHandler)()) {
+      pulseHandler = aPulseHandler;
+    }
+
+    /**
+     * Record how late each pulse fires against its schedule.
+     */
+    void measureJitter(bool on) {
+      noInterrupts();
+      jitter = { INT32_MAX, INT32_MIN, 0, 0 };
+      lateSum = 0;
+      measuring = on;
+      interrupts();
+    }
+
+    ClockJitter getJitter() {
+      noInterrupts();
+      ClockJitter j = jitter;
+      if (j.count) { j.meanLate = lateSum / (int32_t)j.count; }
+      interrupts();
+      return j;
+    }
+
     void update() {
-      t.handle();
+#ifndef ARDUINO_ARCH_RP2040
+      uint32_t now = micros();
+      while (running && (int32_t)(now - nextTick) >= 0) { pulse(); }
+#endif
+      while (handled != pulsen) {
+        if (handled++ % CLOCKS_PER_STEP == 0) {
+          beatn++;
+          if (beatHandler) { beatHandler(beatn); }
+        }
       }
+    }
 
   private:
-    AsyncTimer t;
-    unsigned short intervalId;
-    uint8_t bpm;
-    uint beatn; 
-    std::function<void(uint16_t)> beatHandler;
+    uint32_t tempo;         // BPM * TEMPO_ONE
+    uint32_t period;        // pulse length in us * 256
+    uint32_t nextTick;      // micros() of the next pulse
+    uint16_t frac;          // 1/256 us carried between pulses
+    volatile uint32_t pulsen;
+    uint32_t handled;       // pulses seen by update()
+    uint32_t beatn;
+    volatile bool running;
+
+    uint32_t rampTicks;     // pulses left in the ramp
+    uint8_t rampShape;
+    uint32_t rampTarget;
+    int64_t rampStep;       // tempo per pulse * 65536
+    int32_t rampTempoMul;   // per pulse ratios - 1, * RAMP_ONE
+    int32_t rampPeriodMul;
+
+    bool measuring;
+    ClockJitter jitter;
+    int32_t lateSum;
+
+    std::function<void(uint32_t)> beatHandler;
+    void (*pulseHandler)() = NULL;
+
+#ifdef ARDUINO_ARCH_RP2040
+    static Clock* instance;
+    int alarm = -1;
+
+    static void onAlarm(uint num);
+#endif
+
+    static uint32_t toFixed(float bpm) {
+      if (bpm < MIN_TEMPO) { bpm = MIN_TEMPO; }
+      if (bpm > MAX_TEMPO) { bpm = MAX_TEMPO; }
+      return (uint32_t)(bpm * TEMPO_ONE + 0.5f);
+    }
+
+    static uint32_t periodOf(uint32_t fixedTempo) {
+      return (uint32_t)((60000000ull << 24) / ((uint64_t)fixedTempo * CLOCK_PPQN));
+    }
+
+    /**
+     * One clock pulse. Emits first, does the bookkeeping after.
+     */
+    void pulse() {
+      int32_t late = (int32_t)(micros() - nextTick);
+      if (pulseHandler) { pulseHandler(); }
+      if (measuring) {
+        if (late < jitter.minLate) { jitter.minLate = late; }
+        if (late > jitter.maxLate) { jitter.maxLate = late; }
+        lateSum += late;
+        jitter.count++;
+      }
+      pulsen++;
+      advance();
+    }
+
+    /**
+     * Point the alarm at the next pulse, firing any that are already due.
+     */
+    void arm() {
+#ifdef ARDUINO_ARCH_RP2040
+      while (running) {
+        int32_t wait = (int32_t)(nextTick - time_us_32());
+        if (!hardware_alarm_set_target(alarm, delayed_by_us(get_absolute_time(), wait > 0 ? wait : 0))) { return; }
+        pulse();
+      }
+#endif
+    }
+
+    /**
+     * Schedule the pulse after this one and step a running ramp.
+     */
+    void advance() {
+      nextTick += period >> 8;
+      frac += period & 0xFF;
+      if (frac >= 256) {
+        nextTick++;
+        frac -= 256;
+      }
+
+      if (!rampTicks) { return; }
+      if (--rampTicks == 0) {
+        tempo = rampTarget;
+        period = periodOf(tempo);
+      } else if (rampShape == RAMP_EXPONENTIAL) {
+        tempo += (int32_t)(((int64_t)tempo * rampTempoMul + RAMP_HALF) >> 32);
+        period += (int32_t)(((int64_t)period * rampPeriodMul + RAMP_HALF) >> 32);
+      } else {
+        // from the target back, so rounding never piles up
+        tempo = rampTarget - (int32_t)((rampStep * rampTicks) >> 16);
+        period = periodOf(tempo);
+      }
+    }
+
+    /**
+     * Switch to a new tempo, stretching what is left of the current pulse.
+     */
+    void retime(uint32_t newTempo) {
+      uint32_t newPeriod = periodOf(newTempo);
+      if (running) {
+        uint32_t now = micros();
+        int32_t left = (int32_t)(nextTick - now);
+        if (left < 0) { left = 0; }
+        uint32_t scaled = (((uint64_t)left << 8) + frac) * newPeriod / period;
+        nextTick = now + (scaled >> 8);
+        frac = scaled & 0xFF;
+      }
+      tempo = newTempo;
+      period = newPeriod;
+      arm();
+    }
 };
 
+#ifdef ARDUINO_ARCH_RP2040
+Clock* Clock::instance = NULL;
+
+void __not_in_flash_func(Clock::onAlarm)(uint num) {
+  instance->pulse();
+  instance->arm();
+}
+#endif
+
+
+// lookahead settings
+#define TIMELINE_SIZE 16        // steps kept in the timeline, must be a power of two
+#define DEFAULT_LOOKAHEAD 2     // steps rendered ahead of the next one to play
+
 
 /**
- * Channel class. Contains a sequence and a pattern.
+ * Timeline of rendered steps: per step a channel bitmask, the channels that passed their
+ * chance, the tempo it starts and a row of velocities. Steps are numbered like the clock's
+ * beats and their times are looked up from the clock when asked for, so tempo changes apply
+ * to steps that are already rendered. Outputs read it ahead of time to make up for their
+ * latency.
+*/
+class Timeline {
+  public:
+    Timeline(Clock* clock): clock(clock), end(1), frozen(0), epoch(0) {}
+
+    /**
+     * Drop everything and start again from step 1.
+     */
+    void reset() {
+      end = 1;
+      frozen = 0;
+      epoch++;
+    }
+
+    void push(uint16_t trigs, uint16_t passed, uint16_t tempo) {
+      chance[end & (TIMELINE_SIZE - 1)] = passed;
+      tempos[end & (TIMELINE_SIZE - 1)] = tempo;
+      steps[end++ & (TIMELINE_SIZE - 1)] = trigs;
+    }
+
+    uint16_t& at(uint32_t step) { return steps[step & (TIMELINE_SIZE - 1)]; }
+
+    /**
+     * Velocity of every channel on a step, whether it triggers or not.
+     */
+    uint8_t* velocity(uint32_t step) { return velocities[step & (TIMELINE_SIZE - 1)]; }
+
+    /**
+     * Channels that passed their chance on a step, as rolled when it was rendered.
+     */
+    uint16_t passed(uint32_t step) { return chance[step & (TIMELINE_SIZE - 1)]; }
+
+    /**
+     * Tempo a step switches to when it plays, BPM * 100, 0 keeps the current one.
+     */
+    uint16_t tempo(uint32_t step) { return tempos[step & (TIMELINE_SIZE - 1)]; }
+
+    /**
+     * Oldest step still held.
+     */
+    uint32_t getStart() { return end > TIMELINE_SIZE ? end - TIMELINE_SIZE : 1; }
+
+    /**
+     * One past the last rendered step.
+     */
+    uint32_t getEnd() { return end; }
+
+    uint32_t timeOf(uint32_t step) { return clock->beatTime(step); }
+
+    bool isPlaying() { return clock->isRunning(); }
+
+    /**
+     * Mark a step as sent by some output. Sent steps are never rendered again, so all
+     * outputs play the same thing.
+     */
+    void freeze(uint32_t step) { if (step > frozen) { frozen = step; } }
+
+    uint32_t getFrozen() { return frozen; }
+
+    /**
+     * Changes on every reset, so readers know to rewind.
+     */
+    uint16_t getEpoch() { return epoch; }
+
+  private:
+    Clock* clock;
+    uint16_t steps[TIMELINE_SIZE];
+    uint16_t chance[TIMELINE_SIZE];
+    uint16_t tempos[TIMELINE_SIZE];
+    uint8_t velocities[TIMELINE_SIZE][MAX_CHANNELS];
+    uint32_t end;
+    uint32_t frozen;
+    uint16_t epoch;
+};
+
+
+/**
+ * Channel class. Contains a sequence and a pattern, plus an accent plane tiled the same way
+ * and a velocity lane of 4 bit levels. Both go through a 32 entry table, indexed by
+ * accent << 4 | level, to give each step its velocity with a single load.
 */
 class Channel {
   public:
     /**
      * Constructor with initializer list to initialize member variables.
      */
-    Channel(): seqLength(16), muted(false), pos(15) {
+    Channel(): seqLength(16), muted(false), pos(15), dirty(false), barMask(~0ull), accentPattern(0), twin(NULL) {
+      memset(levels, 0xFF, sizeof(levels));
+      setVelocity(DEFAULT_VELOCITY, DEFAULT_ACCENT_VELOCITY);
       bool emptyPattern[] = { false };
       changeSequence(emptyPattern, 1, DEFAULT_SEQLENGTH);
     }
 
-    Channel(int8_t seqLen): seqLength(seqLen), muted(false), pos(15) {
+    Channel(int8_t seqLen): seqLength(seqLen), muted(false), pos(15), dirty(false), barMask(~0ull), accentPattern(0), twin(NULL) {
+      memset(levels, 0xFF, sizeof(levels));
+      setVelocity(DEFAULT_VELOCITY, DEFAULT_ACCENT_VELOCITY);
       bool emptyPattern[] = { false };
       changeSequence(emptyPattern, 1, seqLen);
     }
@@ -102,56 +487,136 @@ class Channel {
      */
     bool muteToggle() {
         muted = !muted;
+        dirty = true;
         return muted;
     }
 
+    /**
+     * Go back to the top, the next step is the first one.
+     */
+    void restart() { pos = seqLength - 1; }
+
+    /**
+     * Mute or unmute the channel.
+     */
+    void setMuted(bool mute) {
+        muted = mute;
+        dirty = true;
+    }
+
+    bool isMuted() { return muted; }
+
     /**
      * Generate and update the sequence based on the given pattern and sequence length.
+     * Patterns and sequences are packed, step i in bit i.
      */
-    bool* changeSequence(bool newPattern[], uint8_t newPatLength, uint8_t newSeqLength) {
+    uint64_t changeSequence(uint64_t newPattern, uint8_t newPatLength, uint8_t newSeqLength) {
       // Use 'this->' to distinguish between member variables and parameters
       this->patLength = newPatLength;
       this->seqLength = newSeqLength;
-      
-      // Copy elements from the parameter pattern to the member variable pattern
-      for (uint8_t i = 0; i < patLength; ++i) {
-          pattern[i] = newPattern[i];
-      }
+      this->pattern = newPattern & lengthMask(patLength);
 
-      if (patLength < seqLength) {
-        // Repeat pattern to fill seqLength
-        for (uint8_t i = 0; i < seqLength; ++i) {
-          sequence[i] = newPattern[i % patLength];
-        }
-      } else {
-        // Truncate pattern to fit seqLength
-        for (uint8_t i = 0; i < seqLength; ++i) {
-          sequence[i] = newPattern[i];
-        }
-      }
+      // Repeat pattern to fill seqLength, truncate it to fit
+      sequence = tile(pattern);
+      accents = tile(accentPattern & lengthMask(patLength));
 
       // Adjust the position if necessary
       if (pos >= seqLength) {
           pos = seqLength - 1;
       }
+      dirty = true;
 
       // Return the generated sequence
       return sequence;
     }
 
-    bool* changeSequence(uint8_t newSeqLength) {
+    uint64_t changeSequence(bool newPattern[], uint8_t newPatLength, uint8_t newSeqLength) {
+      uint64_t packed = 0;
+      for (uint8_t i = 0; i < newPatLength; ++i) {
+        if (newPattern[i]) { packed |= 1ull << i; }
+      }
+      return changeSequence(packed, newPatLength, newSeqLength);
+    }
+
+    uint64_t changeSequence(uint8_t newSeqLength) {
       return changeSequence(pattern, patLength, newSeqLength);
     }
 
-    bool* changeSequence(bool newPattern[], uint8_t newPatLength) {
+    uint64_t changeSequence(bool newPattern[], uint8_t newPatLength) {
       return changeSequence(newPattern, newPatLength, seqLength);
     }
 
 
     /**
-     * Get the current sequence.
+     * Set which steps of the pattern are accented, step i in bit i. Tiled like the pattern.
+     */
+    void changeAccents(uint64_t newAccents) {
+      putAccents(newAccents);
+      if (twin) { twin->putAccents(newAccents); }
+      dirty = true;
+    }
+
+    /**
+     * Set the level of a step of the sequence, 0 to MAX_LEVEL.
+     */
+    void setLevel(uint8_t step, uint8_t level) {
+      putLevel(step, level);
+      if (twin) { twin->putLevel(step, level); }
+      dirty = true;
+    }
+
+    uint8_t getLevel(uint8_t step) { return (levels[step >> 1] >> ((step & 1) * 4)) & 0x0F; }
+
+    /**
+     * Set the whole velocity lane at once, packed two steps per byte like getLevels().
+     */
+    void setLevels(const uint8_t* packed) {
+      memcpy(levels, packed, sizeof(levels));
+      if (twin) { memcpy(twin->levels, packed, sizeof(levels)); }
+      dirty = true;
+    }
+
+    /**
+     * The velocity lane, MAX_SEQLENGTH / 2 bytes, even steps in the low nibble.
+     */
+    const uint8_t* getLevels() { return levels; }
+
+    /**
+     * Set the velocities of plain and accented steps at MAX_LEVEL, lower levels scale them down.
+     */
+    void setVelocity(uint8_t base, uint8_t accent) {
+      putVelocity(base, accent);
+      if (twin) { twin->putVelocity(base, accent); }
+      dirty = true;
+    }
+
+    uint8_t getVelocity() { return velocity; }
+
+    uint8_t getAccentVelocity() { return accentVelocity; }
+
+    uint64_t getAccents() { return accentPattern & lengthMask(patLength); }
+
+    uint8_t getPatternLength() { return patLength; }
+
+    /**
+     * Give another channel this one's accents, levels and velocities and keep it in step from
+     * now on: every change to either is written to both. The sequencer pairs each channel
+     * with its standby, so a scene switch carries the dynamics over without copying.
+     */
+    void pair(Channel& other) {
+      memcpy(other.levels, levels, sizeof(levels));
+      memcpy(other.velocities, velocities, sizeof(velocities));
+      other.velocity = velocity;
+      other.accentVelocity = accentVelocity;
+      other.putAccents(accentPattern);
+      twin = &other;
+      other.twin = this;
+    }
+
+    /**
+     * Get the current sequence, step i in bit i.
      */
-    bool* getSequence() { return sequence; }
+    uint64_t getSequence() { return sequence; }
 
     uint8_t getSequenceLength() { return seqLength; }
 
@@ -160,18 +625,131 @@ class Channel {
      */
     bool step() {
       offsetPos(1);
-      return sequence[pos] && !muted;
+      return ((sequence & barMask) >> pos) & 1 && !muted;
+    }
+
+    /**
+     * Velocity of the current step.
+     */
+    uint8_t stepVelocity() { return velocityOf(pos); }
+
+    /**
+     * Whether the next step starts a new bar.
+     */
+    bool barEnds() { return pos == seqLength - 1; }
+
+    /**
+     * Set the steps allowed to fire in the coming bar, ANDed with the sequence.
+     */
+    void setBarMask(uint64_t mask) { barMask = mask; }
+
+    /**
+     * Whether the current step passed its chance this bar.
+     */
+    bool passes() { return (barMask >> pos) & 1; }
+
+    /**
+     * Whether the step the given number of steps before the current one is in the sequence
+     * and not muted. Chance is left out, the timeline keeps what each step rolled.
+     */
+    bool at(uint8_t back) { return (sequence >> posBack(back)) & 1 && !muted; }
+
+    uint8_t velocityAt(uint8_t back) { return velocityOf(posBack(back)); }
+
+    /**
+     * Position of the step the given number of steps before the current one.
+     */
+    uint8_t posBack(uint8_t back) { return (pos + seqLength - back % seqLength) % seqLength; }
+
+    /**
+     * True once after every change of the sequence or mute.
+     */
+    bool changed() {
+      bool was = dirty;
+      dirty = false;
+      return was;
+    }
+
+    static uint64_t lengthMask(uint8_t length) {
+      return length >= 64 ? ~0ull : (1ull << length) - 1;
+    }
+
+    static uint8_t scaleVelocity(uint8_t velocity, uint8_t level) {
+      uint8_t v = (velocity * (level + 1) + 8) >> 4;
+      return v ? v : 1;
     }
 
 private:
-    bool pattern[MAX_SEQLENGTH];
+    uint64_t pattern;
     uint8_t patLength;
-    bool sequence[MAX_SEQLENGTH];
+    uint64_t sequence;
     uint8_t seqLength;
     uint8_t pos;     // where in the current seq we are
     bool muted;
+    bool dirty;
+    uint64_t barMask;       // steps that pass their chance this bar
+
+    uint64_t accentPattern;
+    uint64_t accents;       // accentPattern tiled like the sequence
+    uint8_t levels[MAX_SEQLENGTH / 2];  // two steps per byte, even steps in the low nibble
+    uint8_t velocities[32];
+    uint8_t velocity;
+    uint8_t accentVelocity;
+    Channel* twin;          // paired channel the dynamics are mirrored to
+
+    void putAccents(uint64_t newAccents) {
+      accentPattern = newAccents;
+      accents = tile(accentPattern & lengthMask(patLength));
+    }
+
+    void putLevel(uint8_t step, uint8_t level) {
+      uint8_t shift = (step & 1) * 4;
+      levels[step >> 1] = (levels[step >> 1] & ~(0x0F << shift)) | ((level & 0x0F) << shift);
+    }
+
+    void putVelocity(uint8_t base, uint8_t accent) {
+      velocity = base > 127 ? 127 : base;
+      accentVelocity = accent > 127 ? 127 : accent;
+      for (uint8_t l = 0; l < 16; l++) {
+        velocities[l] = scaleVelocity(velocity, l);
+        velocities[16 + l] = scaleVelocity(accentVelocity, l);
+      }
+    }
+
+    uint8_t velocityOf(uint8_t p) {
+      return velocities[(((accents >> p) & 1) << 4) | ((levels[p >> 1] >> ((p & 1) * 4)) & 0x0F)];
+    }
+
+    uint64_t tile(uint64_t pat) {
+      uint64_t tiled = 0;
+      for (uint8_t i = 0; i < seqLength; i += patLength) {
+        tiled |= pat << i;
+      }
+      return tiled & lengthMask(seqLength);
+    }
+};
+
+
+
+/**
+ * One channel of a scene.
+ */
+struct SceneChannel {
+  uint8_t length;         // steps
+  uint8_t pulses;         // euclidean pulses spread over the steps
+  uint8_t rotation;       // steps the rhythm starts in
 };
 
+/**
+ * A scene of a song, 54 bytes so a few hundred fit in RAM or flash.
+ */
+struct Scene {
+  uint16_t tempo;         // BPM * 100, 0 keeps the current tempo
+  uint16_t mutes;         // bit per channel
+  uint8_t barLength;      // steps per bar
+  uint8_t repeats;        // bars played before the next scene
+  SceneChannel channels[MAX_CHANNELS];
+};
 
 
 /*
@@ -182,29 +760,38 @@ class MIDISequencer
   public:
   
   // constructors
-  MIDISequencer(uint8_t nChannels): nChannels(nChannels) {
+  MIDISequencer(uint8_t nChannels): nChannels(nChannels), maxSeqLength(MAX_SEQLENGTH), timeline(&clock), lookahead(DEFAULT_LOOKAHEAD) {
     channels = new Channel[nChannels];
+    standby = new Channel[nChannels];
+    seed(DEFAULT_SEED);
+    pairChannels();
   }
 
-  MIDISequencer(uint8_t nChannels, uint8_t seqLeng): nChannels(nChannels), maxSeqLength(seqLeng) {
+  MIDISequencer(uint8_t nChannels, uint8_t seqLeng): nChannels(nChannels), maxSeqLength(seqLeng), timeline(&clock), lookahead(DEFAULT_LOOKAHEAD) {
     channels = new Channel[nChannels];
+    standby = new Channel[nChannels];
+    seed(DEFAULT_SEED);
     for (uint8_t i = 0; i < nChannels; ++i) {
       channels[i] = Channel(seqLeng);
     }
+    pairChannels();
   }
 
-  MIDISequencer(uint8_t nChannels, uint8_t seqLeng, uint8_t maxSeqLeng): nChannels(nChannels), maxSeqLength(maxSeqLeng) {
+  MIDISequencer(uint8_t nChannels, uint8_t seqLeng, uint8_t maxSeqLeng): nChannels(nChannels), maxSeqLength(maxSeqLeng), timeline(&clock), lookahead(DEFAULT_LOOKAHEAD) {
     channels = new Channel[nChannels];
+    standby = new Channel[nChannels];
+    seed(DEFAULT_SEED);
     for (uint8_t i = 0; i < nChannels; ++i) {
       channels[i] = Channel(seqLeng);
     }
+    pairChannels();
   }
 
   /**
    * Set the function to call at the top of a beat.
    * Use std::function to allow for other class's member functions and other.
   */
-  void setBeatHandler(void (*aBeatHandler)(uint8_t* pos, bool** allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum)) {
+  void setBeatHandler(void (*aBeatHandler)(uint8_t* pos, uint64_t* allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum)) {
     beatHandler = aBeatHandler;
   }
   
@@ -216,11 +803,30 @@ class MIDISequencer
     triggerHandler = aTriggerHandler;
   }
   
+  /**
+   * Set the function to call on every MIDI clock pulse. Runs in the timer interrupt.
+  */
+  void setClockHandler(void (*aClockHandler)()) {
+    clock.setPulseHandler(aClockHandler);
+  }
+
+  /**
+   * Set the function to call on start, stop and continue with the song position in 16ths.
+  */
+  void setTransportHandler(void (*aTransportHandler)(uint8_t status, uint16_t songPosition)) {
+    transportHandler = aTransportHandler;
+  }
+
   /*
-   * Set the tempo in beats per minute
+   * Set the tempo in beats per minute, keeping the position in the pattern
    */
   void setTempo( float bpm ) { clock.setTempo(bpm); }
 
+  /*
+   * Ramp to a tempo over a number of beats, see Clock::rampTempo
+   */
+  void rampTempo( float bpm, uint16_t beats, uint8_t shape = RAMP_LINEAR ) { clock.rampTempo(bpm, beats, shape); }
+
   float getTempo() { return clock.getTempo(); }
 
   void setLength( uint8_t length ) { 
@@ -252,16 +858,82 @@ class MIDISequencer
     setLength(length + offset);
   }
 
-  bool* step(uint16_t beatnum) {
+  /**
+   * Set how many steps are rendered ahead of the next one to play. Outputs can be fed
+   * up to this many steps early.
+  */
+  void setLookahead( uint8_t steps ) {
+    lookahead = steps < TIMELINE_SIZE / 2 ? steps : TIMELINE_SIZE / 2;
+  }
+
+  uint8_t getLookahead() { return lookahead; }
+
+  Timeline& getTimeline() { return timeline; }
+
+  /**
+   * Play a chain of scenes, looping at the end. The chain is read in place and can live
+   * in flash. Each scene is compiled into a standby set of channels while the one before
+   * it plays, and swapped in on its first step.
+  */
+  void playSong(const Scene* aSong, uint16_t aSongLength, uint16_t fromScene = 0) {
+    song = aSong;
+    songLength = aSongLength;
+    nextScene = fromScene % songLength;
+    prefetch();
+    sceneLeft = 0;
+  }
+
+  /**
+   * Keep playing the current scene's channels as a plain pattern.
+  */
+  void stopSong() { song = NULL; }
+
+  /**
+   * Index of the scene being rendered.
+  */
+  uint16_t getScene() { return scene; }
+
+  /**
+   * Set the chance of a channel's step firing, out of 256, CHANCE_ALWAYS by default.
+   * The steps of a bar are rolled together when it starts.
+  */
+  void setChance( uint8_t channel, uint8_t step, uint8_t probability ) { chance[channel].set(step, probability); }
+
+  uint8_t getChance( uint8_t channel, uint8_t step ) { return chance[channel].get(step); }
+
+  /**
+   * Accent a channel with a euclidean rhythm over its pattern length.
+  */
+  void setAccents( uint8_t channel, uint8_t pulses, uint8_t rotation = 0 ) {
+    uint8_t length = channels[channel].getPatternLength();
+    channels[channel].changeAccents(euclideanMask(length, pulses < length ? pulses : length, rotation));
+  }
+
+  /**
+   * Seed the chance of all channels, each lane differently. Sequencers start from
+   * DEFAULT_SEED; a fixed seed plays the same bars every time.
+  */
+  void seed( uint32_t s ) {
+    for (uint8_t i = 0; i < MAX_CHANNELS; ++i) { chance[i].seed(s + i * 0x9E3779B9); }
+  }
+
+  /**
+   * Called by the clock when a step is due. Outputs read the timeline on their own,
+   * the handlers see the step as it plays.
+  */
+  bool* step(uint32_t beatnum) {
     const uint8_t seqLength = getLength();
+    render();
+
+    uint16_t tempo = timeline.tempo(beatnum);
+    if (tempo) { clock.setTempo(tempo / 100.0f); }
 
-    bool* allTrigs = new bool[nChannels];
-    uint8_t* allPos = new uint8_t[nChannels];
-    bool** allSequences = new bool*[MAX_SEQLENGTH];
+    uint16_t trigs = timeline.at(beatnum);
+    uint8_t back = timeline.getEnd() - 1 - beatnum;
 
     for (uint8_t i = 0; i < nChannels; ++i) {
-      allTrigs[i] = channels[i].step();
-      allPos[i] = channels[i].getPos();
+      allTrigs[i] = trigs & (1 << i);
+      allPos[i] = channels[i].posBack(back);
       allSequences[i] = channels[i].getSequence();
     }
 
@@ -275,25 +947,164 @@ class MIDISequencer
   }
 
   void start() { 
-    clock.setBeatHandler([this](uint16_t beatnum) { step(beatnum); });
-    clock.setTempo(DEFAULT_TEMPO);
+    clock.setBeatHandler([this](uint32_t beatnum) { step(beatnum); });
+    if (transportHandler) { transportHandler(MIDI_START, 0); }
+    for (uint8_t i = 0; i < nChannels; ++i) { channels[i].restart(); }
+    if (song) { playSong(song, songLength); }
+    timeline.reset();
+    sceneStart = 1;
     clock.start(); 
+    render();
     }
 
-  void stop() { clock.stop(); }
+  void stop() {
+    clock.stop();
+    if (transportHandler) { transportHandler(MIDI_STOP, 0); }
+  }
 
-  void update() { clock.update(); }
+  /**
+   * Continue from where the sequencer was stopped, on the next 16th note.
+  */
+  void resume() {
+    if (clock.isRunning()) { return; }
+    uint16_t songPosition = clock.alignSongPosition();
+    if (transportHandler) { transportHandler(MIDI_CONTINUE, songPosition); }
+    clock.resume();
+  }
+
+  bool isPlaying() { return clock.isRunning(); }
+
+  /**
+   * Record the lateness of the clock pulses, see Clock::measureJitter
+  */
+  void measureJitter(bool on) { clock.measureJitter(on); }
+
+  ClockJitter getJitter() { return clock.getJitter(); }
+
+  void update() {
+    for (uint8_t i = 0; i < nChannels; ++i) {
+      if (channels[i].changed()) { rerender(i); }
+    }
+    if (song && !prefetched) { prefetch(); }
+    if (clock.isRunning()) { render(); }
+    clock.update();
+  }
 
 
   uint8_t nChannels;
   Channel* channels;
+  Channel* standby;       // next scene, compiled ahead
 
 
   private:    
     Clock clock;
     uint8_t maxSeqLength;
-    void (*triggerHandler)(bool* allTrigs, uint8_t nChannels);
-    void (*beatHandler)(uint8_t* pos, bool** allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum);
+    Timeline timeline;
+    uint8_t lookahead;
+
+    ChanceLane chance[MAX_CHANNELS];
+
+    bool allTrigs[MAX_CHANNELS];
+    uint8_t allPos[MAX_CHANNELS];
+    uint64_t allSequences[MAX_CHANNELS];
+    void (*triggerHandler)(bool* allTrigs, uint8_t nChannels) = NULL;
+    void (*beatHandler)(uint8_t* pos, uint64_t* allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum) = NULL;
+    void (*transportHandler)(uint8_t status, uint16_t songPosition) = NULL;
+
+    const Scene* song = NULL;
+    uint16_t songLength = 0;
+    uint16_t scene = 0;
+    uint16_t nextScene = 0;
+    bool prefetched = false;
+    uint16_t sceneLeft = 0;     // steps left to render in the scene
+    uint32_t sceneStart = 1;    // first timeline step of the scene
+
+    /**
+     * Pair every channel with its standby, which then always has the same dynamics.
+     */
+    void pairChannels() {
+      for (uint8_t i = 0; i < nChannels; ++i) { channels[i].pair(standby[i]); }
+    }
+
+    /**
+     * Compile the next scene into the standby channels.
+     */
+    void prefetch() {
+      const Scene& sc = song[nextScene];
+      for (uint8_t i = 0; i < nChannels; ++i) {
+        // songs come over the link or from flash and are played in place. A length of 0
+        // would divide by zero in offsetPos(), one over MAX_SEQLENGTH would shift past the
+        // 64 bit sequence. Pulses and rotation are clamped by euclideanMask.
+        uint8_t length = sc.channels[i].length;
+        if (length < 1) { length = 1; }
+        if (length > MAX_SEQLENGTH) { length = MAX_SEQLENGTH; }
+        standby[i].changeSequence(euclideanMask(length, sc.channels[i].pulses, sc.channels[i].rotation), length, length);
+        standby[i].setMuted(sc.mutes & (1 << i));
+        standby[i].restart();
+        standby[i].changed();
+      }
+      prefetched = true;
+    }
+
+    /**
+     * Swap in the prefetched scene at the step being rendered.
+     */
+    void switchScene() {
+      if (!prefetched) { prefetch(); }    // the scene before was shorter than an update
+
+      Channel* next = standby;
+      standby = channels;
+      channels = next;
+
+      scene = nextScene;
+      nextScene = (scene + 1) % songLength;
+      prefetched = false;
+
+      const Scene& sc = song[scene];
+      sceneLeft = (uint16_t)(sc.barLength ? sc.barLength : 1) * (sc.repeats ? sc.repeats : 1);
+      sceneStart = timeline.getEnd();
+    }
+
+    /**
+     * Step the channels into the timeline until it is lookahead steps past the next one.
+     */
+    void render() {
+      while (timeline.getEnd() <= clock.getBeat() + 1 + lookahead) {
+        uint16_t tempo = 0;
+        if (song) {
+          if (sceneLeft == 0) {
+            switchScene();
+            tempo = song[scene].tempo;
+          }
+          sceneLeft--;
+        }
+        uint16_t trigs = 0;
+        uint16_t passed = 0;
+        uint8_t* velocity = timeline.velocity(timeline.getEnd());
+        for (uint8_t i = 0; i < nChannels; ++i) {
+          if (channels[i].barEnds()) { channels[i].setBarMask(chance[i].roll(channels[i].getSequenceLength())); }
+          trigs |= channels[i].step() << i;
+          passed |= channels[i].passes() << i;
+          velocity[i] = channels[i].stepVelocity();
+        }
+        timeline.push(trigs, passed, tempo);
+      }
+    }
+
+    /**
+     * Redo one channel's rendered steps that no output has sent yet.
+     */
+    void rerender(uint8_t ch) {
+      uint32_t end = timeline.getEnd();
+      uint32_t from = timeline.getFrozen() + 1;
+      if (from < timeline.getStart()) { from = timeline.getStart(); }
+      if (from < sceneStart) { from = sceneStart; }
+      for (uint32_t s = from; s < end; s++) {
+        if (channels[ch].at(end - 1 - s) && timeline.passed(s) & (1 << ch)) { timeline.at(s) |= 1 << ch; }
+        else { timeline.at(s) &= ~(1 << ch); }
+        timeline.velocity(s)[ch] = channels[ch].velocityAt(end - 1 - s);
+      }
+    }
 
    
 };
@@ -0,0 +1,49 @@
+// Host stand-in for the Arduino core, enough to build the firmware headers for the sim/ harnesses.
+// Time is virtual: harnesses move hostMicros forward themselves.
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef unsigned int uint;
+
+inline uint32_t hostMicros = 0;
+inline unsigned long micros() { return hostMicros; }
+inline unsigned long millis() { return hostMicros / 1000; }
+
+#define OUTPUT 1
+#define INPUT 0
+#define INPUT_PULLUP 2
+#define INPUT_PULLDOWN 3
+#define HIGH 1
+#define LOW 0
+#define A1 27
+#define A2 28
+
+// pin levels, harnesses drive inputs by writing here. Everything idles high, as on a pull-up.
+inline uint8_t hostPins[64] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+inline void pinMode(int, int) {}
+inline void digitalWrite(int pin, int level) { hostPins[pin & 63] = level; }
+inline int digitalRead(int pin) { return hostPins[pin & 63]; }
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+struct HostSerial {
+  void begin(unsigned long) {}
+  void setTX(int) {}
+  void setRX(int) {}
+  template<class T> size_t print(T) { return 0; }
+  template<class T> size_t println(T) { return 0; }
+  size_t println() { return 0; }
+  size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t*, size_t n) { return n; }
+  int available() { return 0; }
+  int read() { return -1; }
+};
+inline HostSerial Serial, Serial1;
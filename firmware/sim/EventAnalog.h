@@ -0,0 +1,34 @@
+// Host stand-in for EventAnalog: takes the settings and never fires.
+#pragma once
+#include <Arduino.h>
+
+class EventAnalog {
+  public:
+    typedef void (*Handler)(EventAnalog&);
+
+    EventAnalog(byte pin): pin(pin) {}
+
+    void update() {}
+    int16_t position() { return 0; }
+
+    void setChangedHandler(Handler h) { changedHandler = h; }
+    void setIdleHandler(Handler h) { idleHandler = h; }
+    void setNumIncrements(uint8_t) {}
+    void setNumNegativeIncrements(uint8_t) {}
+    void setNumPositiveIncrements(uint8_t) {}
+    void setStartValue(uint16_t) {}
+    void setStartBoundary(uint16_t) {}
+    void setEndBoundary(uint16_t) {}
+    void setRateLimit(uint16_t) {}
+
+    void setUserId(unsigned int id) { uid = id; }
+    unsigned int userId() { return uid; }
+    void setUserState(unsigned int state) { ustate = state; }
+
+  private:
+    byte pin;
+    unsigned int uid = 0;
+    unsigned int ustate = 0;
+    Handler changedHandler = NULL;
+    Handler idleHandler = NULL;
+};
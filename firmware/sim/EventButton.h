@@ -0,0 +1,93 @@
+// Host stand-in for EventButton: reads its pin through digitalRead() on virtual time. Presses
+// are debounced like Bounce2's default mode, a level counts once it has been stable this long.
+#pragma once
+#include <Arduino.h>
+
+#define EVENTBUTTON_DEBOUNCE_MS 15
+
+class EventButton {
+  public:
+    typedef void (*Handler)(EventButton&);
+
+    EventButton(byte pin): pin(pin) {}
+
+    void update() {
+      unsigned long now = millis();
+      bool level = digitalRead(pin);
+      if (level != lastLevel) {
+        lastLevel = level;
+        changedAt = now;
+      }
+      bool down = !lastLevel;
+      if (down != pressed && now - changedAt >= debounce) {
+        pressed = down;
+        if (pressed) {
+          pressedAt = now;
+          longPresses = 0;
+          if (pressedHandler) { pressedHandler(*this); }
+        } else {
+          if (releasedHandler) { releasedHandler(*this); }
+          if (longPresses) { if (longClickHandler) { longClickHandler(*this); } }
+          else { clicks++; releasedAt = now; }
+        }
+      }
+      if (pressed && now - pressedAt >= (unsigned long)longClickDuration * (longPresses + 1)) {
+        if (longPresses == 0 || longPressRepeat) {
+          if (longPressHandler) { longPressHandler(*this); }
+        }
+        longPresses++;
+      }
+      if (!pressed && clicks && now - releasedAt >= multiClickInterval) {
+        if (clicks > 1 && doubleClickHandler) { doubleClickHandler(*this); }
+        else if (clickHandler) { clickHandler(*this); }
+        clicks = 0;
+      }
+    }
+
+    bool isPressed() { return pressed; }
+
+    void setClickHandler(Handler h) { clickHandler = h; }
+    void setDoubleClickHandler(Handler h) { doubleClickHandler = h; }
+    void setLongClickHandler(Handler h) { longClickHandler = h; }
+    void setLongPressHandler(Handler h, bool repeat = false) { longPressHandler = h; longPressRepeat = repeat; }
+    void setPressedHandler(Handler h) { pressedHandler = h; }
+    void setReleasedHandler(Handler h) { releasedHandler = h; }
+    void setIdleHandler(Handler h) { idleHandler = h; }
+
+    void setLongClickDuration(unsigned int ms) { longClickDuration = ms; }
+    void setMultiClickInterval(unsigned int ms) { multiClickInterval = ms; }
+    void setIdleTimeout(unsigned int ms) { idleTimeout = ms; }
+    void setDebounceInterval(unsigned int ms) { debounce = ms; }
+
+    void setUserId(unsigned int id) { uid = id; }
+    unsigned int userId() { return uid; }
+    void setUserState(unsigned int state) { ustate = state; }
+    unsigned int userState() { return ustate; }
+    uint8_t longPressCount() { return longPresses; }
+
+  private:
+    byte pin;
+    bool lastLevel = true;
+    bool pressed = false;
+    unsigned long changedAt = 0;
+    unsigned long pressedAt = 0;
+    unsigned long releasedAt = 0;
+    uint8_t clicks = 0;
+    uint8_t longPresses = 0;
+    bool longPressRepeat = false;
+
+    unsigned int debounce = EVENTBUTTON_DEBOUNCE_MS;
+    unsigned int longClickDuration = 750;
+    unsigned int multiClickInterval = 250;
+    unsigned int idleTimeout = 10000;
+    unsigned int uid = 0;
+    unsigned int ustate = 0;
+
+    Handler clickHandler = NULL;
+    Handler doubleClickHandler = NULL;
+    Handler longClickHandler = NULL;
+    Handler longPressHandler = NULL;
+    Handler pressedHandler = NULL;
+    Handler releasedHandler = NULL;
+    Handler idleHandler = NULL;
+};
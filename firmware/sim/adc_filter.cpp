@@ -0,0 +1,122 @@
+/*
+ * Knob filtering: runs noisy sample streams through AnalogPipeline the way the ADC interrupt
+ * would and checks that a still knob never publishes a change, that a turned one settles in
+ * time without chattering on the way, and that the first value lands where the knob is.
+ * Exits non-zero when a check fails.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. sim/adc_filter.cpp -o adc_filter && ./adc_filter
+ *
+ * Options: --seed S, --stream FILE (recorded raw 12 bit conversions, one per line, played on
+ * a still knob instead of the synthetic noise).
+ */
+#include <Arduino.h>
+#include <vector>
+#include "adc.h"
+
+// setup
+#define KNOBS 2
+#define RAW_RATE (ADC_SAMPLE_RATE / KNOBS)     // conversions per second per knob
+#define NOISE_LSB 3             // gaussian-ish noise on every conversion
+#define SPIKE_LSB 20            // occasional code spikes, as the RP2040's ADC has
+#define SPIKE_ONE_IN 200
+#define STEP_FROM 1000
+#define STEP_TO 3000
+#define STILL_AT 2048
+#define SEGMENT_S 2
+
+// budgets
+#define SETTLE_MS 250           // step until the published value stays within SETTLE_LSB
+#define SETTLE_LSB 8
+#define FIRST_LSB 8             // first published value from where the knob is
+
+static uint32_t rng = 1;
+static unsigned changes[KNOBS];
+
+static uint32_t rnd() {
+  rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+  return rng;
+}
+
+/**
+ * One noisy conversion of a knob sitting at level
+ */
+static uint16_t noisy(int level) {
+  int n = 0;
+  for (uint8_t k = 0; k < 4; k++) { n += (int)(rnd() % (2 * NOISE_LSB + 1)) - NOISE_LSB; }
+  int v = level + n / 2;
+  if (rnd() % SPIKE_ONE_IN == 0) { v += rnd() & 1 ? SPIKE_LSB : -SPIKE_LSB; }
+  return v < 0 ? 0 : v > 4095 ? 4095 : v;
+}
+
+static void changedH(AnalogPipeline& ap, uint8_t id) { changes[id]++; }
+
+static int distance(uint16_t a, uint16_t b) { return a > b ? a - b : b - a; }
+
+int main(int argc, char** argv) {
+  std::vector<uint16_t> recorded;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--seed")) { rng = strtoul(argv[i + 1], NULL, 0) | 1; }
+    else if (!strcmp(argv[i], "--stream")) {
+      FILE* f = fopen(argv[i + 1], "r");
+      if (!f) { printf("cannot open %s\n", argv[i + 1]); return 1; }
+      unsigned v;
+      while (fscanf(f, "%u", &v) == 1) { recorded.push_back(v & 0xFFF); }
+      fclose(f);
+    }
+  }
+
+  byte pins[KNOBS] = { ADC_FIRST_PIN, ADC_FIRST_PIN + 1 };
+  AnalogPipeline knobs(pins, KNOBS);
+  knobs.setChangedHandler(changedH);
+  bool ok = true;
+
+  // knob 0 sits, then jumps; knob 1 stays still throughout
+  unsigned total = 2 * SEGMENT_S * RAW_RATE;
+  unsigned stepAt = total / 2;
+  unsigned settledAt = 0;
+  unsigned changesBeforeStep = 0;
+  uint16_t lastPosition = 0;
+  bool chatter = false;
+  bool first = true;
+
+  for (unsigned t = 0; t < total; t += ADC_OVERSAMPLE) {
+    if (t == stepAt) { changesBeforeStep = changes[0] - changesBeforeStep; }
+    uint16_t raw0[ADC_OVERSAMPLE], raw1[ADC_OVERSAMPLE];
+    for (uint8_t k = 0; k < ADC_OVERSAMPLE; k++) {
+      raw0[k] = noisy(t + k < stepAt ? STEP_FROM : STEP_TO);
+      raw1[k] = recorded.empty() ? noisy(STILL_AT) : recorded[(t + k) % recorded.size()];
+    }
+    knobs.feed(0, raw0, ADC_OVERSAMPLE);
+    knobs.feed(1, raw1, ADC_OVERSAMPLE);
+    knobs.update();
+
+    if (first) {
+      first = false;
+      int off = distance(knobs.value(0), STEP_FROM);
+      printf("first value       %4u, %d from the knob (budget %d)\n", knobs.value(0), off, FIRST_LSB);
+      ok &= off <= FIRST_LSB;
+      changesBeforeStep = changes[0];
+      lastPosition = knobs.position(0);
+    }
+
+    if (t < stepAt) { continue; }
+    if (knobs.position(0) < lastPosition) { chatter = true; }
+    lastPosition = knobs.position(0);
+    bool within = distance(knobs.value(0), STEP_TO) <= SETTLE_LSB;
+    if (within && !settledAt) { settledAt = t + ADC_OVERSAMPLE; }
+    if (!within) { settledAt = 0; }
+  }
+
+  float settleMs = settledAt ? (settledAt - stepAt) * 1000.0f / RAW_RATE : -1;
+  printf("settle            %6.1f ms to within %d (budget %d ms)\n", settleMs, SETTLE_LSB, SETTLE_MS);
+  ok &= settledAt && settleMs <= SETTLE_MS;
+  printf("still knob 0      %u spurious changes\n", changesBeforeStep);
+  ok &= changesBeforeStep == 0;
+  printf("still knob 1      %u spurious changes%s\n", changes[1] - 1, recorded.empty() ? "" : " (recorded)");
+  ok &= changes[1] == 1;
+  printf("turned knob       %s\n", chatter ? "position went backwards" : "position only moved forward");
+  ok &= !chatter;
+
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * Chance lanes: renders bars of several channels set to the same probability and checks that
+ * they roll independently, that each fires as often as its probability says, and that a
+ * fixed seed replays the same bars while a different one does not. Exits non-zero when a
+ * check fails.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. sim/chance_lanes.cpp -o chance_lanes && ./chance_lanes
+ *
+ * Options: --steps N, --seed S.
+ */
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+#include "sequencer.h"
+
+// setup
+#define CHANNELS 4
+#define LENGTH 16
+#define PROBABILITY 128         // out of 256
+#define BPM 300
+
+// budgets
+#define RATE_TOLERANCE 0.05     // firing rate off PROBABILITY / 256
+#define AGREE_TOLERANCE 0.05    // two independent lanes agree on half the steps
+
+/**
+ * Play a sequencer on virtual time and record the trigger mask of every rendered step
+ */
+static std::vector<uint16_t> play(bool seeded, uint32_t s, unsigned steps) {
+  MIDISequencer seq(CHANNELS);
+  if (seeded) { seq.seed(s); }
+  for (uint8_t i = 0; i < CHANNELS; i++) {
+    seq.channels[i].changeSequence(~0ull, LENGTH, LENGTH);
+    for (uint8_t k = 0; k < LENGTH; k++) { seq.setChance(i, k, PROBABILITY); }
+  }
+  seq.setTempo(BPM);
+  seq.start();
+
+  std::vector<uint16_t> trigs;
+  Timeline& timeline = seq.getTimeline();
+  uint32_t next = timeline.getEnd();
+  while (trigs.size() < steps) {
+    hostMicros += 100;
+    seq.update();
+    for (; next < timeline.getEnd() && trigs.size() < steps; next++) { trigs.push_back(timeline.at(next)); }
+  }
+  seq.stop();
+  return trigs;
+}
+
+int main(int argc, char** argv) {
+  unsigned steps = 1600;
+  uint32_t s = 1234;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--steps")) { steps = atoi(argv[i + 1]); }
+    else if (!strcmp(argv[i], "--seed")) { s = strtoul(argv[i + 1], NULL, 0); }
+  }
+  bool ok = true;
+
+  // lanes of one sequencer, as constructed
+  std::vector<uint16_t> trigs = play(false, 0, steps);
+  double expected = PROBABILITY / 256.0;
+  for (uint8_t i = 0; i < CHANNELS; i++) {
+    unsigned fired = 0;
+    for (uint16_t t : trigs) { fired += (t >> i) & 1; }
+    double rate = (double)fired / steps;
+    bool good = fabs(rate - expected) <= RATE_TOLERANCE;
+    printf("channel %u         fires %.3f of steps (expected %.3f)  %s\n", i, rate, expected, good ? "ok" : "OFF");
+    ok &= good;
+  }
+  double worst = 0;
+  for (uint8_t a = 0; a < CHANNELS; a++) {
+    for (uint8_t b = a + 1; b < CHANNELS; b++) {
+      unsigned agree = 0;
+      for (uint16_t t : trigs) { agree += ((t >> a) & 1) == ((t >> b) & 1); }
+      double off = fabs((double)agree / steps - 0.5);
+      if (off > worst) { worst = off; }
+    }
+  }
+  bool independent = worst <= AGREE_TOLERANCE;
+  printf("lane pairs        agree %.3f off a half at worst (budget %.2f)  %s\n", worst, AGREE_TOLERANCE, independent ? "ok" : "CORRELATED");
+  ok &= independent;
+
+  // replays
+  bool same = play(false, 0, steps) == trigs;
+  printf("default seed      %s\n", same ? "replays the same bars" : "plays different bars");
+  ok &= same;
+  std::vector<uint16_t> fixed = play(true, s, steps);
+  same = play(true, s, steps) == fixed;
+  printf("seed %-12u %s\n", s, same ? "replays the same bars" : "plays different bars");
+  ok &= same;
+  bool differs = play(true, s + 1, steps) != fixed;
+  printf("seed %-12u %s\n", s + 1, differs ? "plays other bars" : "plays the same bars");
+  ok &= differs;
+
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/*
+ * Display diffing: drives StepDisplay's playhead, mutes and selection on 16 and 64 step pages
+ * and checks every pushed frame, both how many pixels it re-encoded and that the chain matches
+ * a full redraw of the framebuffer. A moving playhead re-encodes two pixels whatever the page
+ * size. Exits non-zero when a check fails.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. sim/display_frames.cpp -o display_frames && ./display_frames
+ *
+ * Options: --dump (print every frame).
+ */
+#include <Arduino.h>
+#include "display.h"
+
+// setup
+#define CHANNELS 6
+#define PATTERN 0x9249249249249249ull   // steps shown for the selected channel
+#define LAPS 3                          // times the playhead walks the page
+
+static bool dump = false;
+static unsigned frames;
+static uint8_t lastChanged;
+static uint32_t shown[MAX_LEDS];
+static uint8_t shownN;
+
+static void frameH(const uint32_t* pixels, uint8_t n, uint8_t changed) {
+  frames++;
+  lastChanged = changed;
+  shownN = n;
+  for (uint8_t i = 0; i < n; i++) { shown[i] = pixels[i]; }
+  if (!dump) { return; }
+  printf("frame %4u  %2u changed  ", frames, changed);
+  for (uint8_t i = 0; i < n; i++) { printf("%c", pixels[i] ? '#' : '.'); }
+  printf("\n");
+}
+
+/**
+ * What every pixel should show for the framebuffer state, drawn from scratch
+ */
+static bool matches(uint8_t nSteps, uint64_t steps, uint8_t playhead, uint16_t mutes, uint8_t selected) {
+  static const uint32_t stepColors[] = { COLOR_STEP_OFF, COLOR_STEP_ON, COLOR_PLAYHEAD, COLOR_PLAYHEAD_ON };
+  static const uint32_t channelColors[] = { COLOR_CHANNEL, COLOR_MUTED, COLOR_SELECTED, COLOR_MUTED_SEL };
+  if (shownN != nSteps + CHANNELS) { return false; }
+  for (uint8_t i = 0; i < nSteps; i++) {
+    uint32_t c = stepColors[((steps >> i) & 1) | ((i == playhead) << 1)] << 8;
+    if (shown[i] != c) { printf("  step %u shows %06x, expected %06x\n", i, shown[i] >> 8, c >> 8); return false; }
+  }
+  for (uint8_t i = 0; i < CHANNELS; i++) {
+    uint32_t c = channelColors[((mutes >> i) & 1) | ((i == selected) << 1)] << 8;
+    if (shown[nSteps + i] != c) { printf("  channel %u shows %06x, expected %06x\n", i, shown[nSteps + i] >> 8, c >> 8); return false; }
+  }
+  return true;
+}
+
+/**
+ * Let the last frame go out, then push whatever changed. Returns the pixels re-encoded, or -1
+ * when no frame was pushed.
+ */
+static int frame(StepDisplay& display, uint8_t nSteps) {
+  hostMicros += (uint32_t)((nSteps + CHANNELS) * 24 * LED_BIT_US) + LED_LATCH_US;
+  unsigned before = frames;
+  display.update();
+  return frames == before ? -1 : lastChanged;
+}
+
+static bool check(const char* what, int got, int expected) {
+  if (got == expected) { return true; }
+  printf("  %-24s %d pixels, expected %d\n", what, got, expected);
+  return false;
+}
+
+/**
+ * One page size. Returns the most pixels a playhead move re-encoded, 0 on failure.
+ */
+static int run(uint8_t nSteps) {
+  StepDisplay display(0, nSteps, CHANNELS);
+  display.begin();
+  uint64_t steps = PATTERN & (nSteps >= 64 ? ~0ull : (1ull << nSteps) - 1);
+  uint16_t mutes = 0;
+  uint8_t selected = 0;
+  uint8_t playhead = 0;
+  bool ok = true;
+  int worst = 0;
+
+  display.setSteps(steps);
+  display.setPlayhead(playhead);
+  display.setMutes(mutes);
+  display.selectChannel(selected);
+  ok &= check("first frame", frame(display, nSteps), nSteps + CHANNELS);
+  ok &= matches(nSteps, steps, playhead, mutes, selected);
+
+  // a new frame can't start while the last is still going out
+  display.setPlayhead(++playhead);
+  unsigned before = frames;
+  display.update();
+  ok &= check("while busy", frames == before ? -1 : lastChanged, -1);
+  ok &= check("after busy", frame(display, nSteps), 2);
+  ok &= matches(nSteps, steps, playhead, mutes, selected);
+  ok &= check("nothing changed", frame(display, nSteps), -1);
+
+  for (unsigned n = 0; n < LAPS * nSteps; n++) {
+    playhead = (playhead + 1) % nSteps;
+    display.setPlayhead(playhead);
+    int changed = frame(display, nSteps);
+    ok &= check("playhead", changed, 2);
+    ok &= matches(nSteps, steps, playhead, mutes, selected);
+    if (changed > worst) { worst = changed; }
+
+    if (n % 5 == 0) {
+      mutes ^= 1 << (n % CHANNELS);
+      display.setMutes(mutes);
+      ok &= check("mute", frame(display, nSteps), 1);
+      ok &= matches(nSteps, steps, playhead, mutes, selected);
+    }
+    if (n % 7 == 0) {
+      selected = (selected + 1) % CHANNELS;
+      display.selectChannel(selected);
+      ok &= check("select", frame(display, nSteps), 2);
+      ok &= matches(nSteps, steps, playhead, mutes, selected);
+    }
+  }
+
+  display.refresh();
+  ok &= check("refresh", frame(display, nSteps), nSteps + CHANNELS);
+  ok &= matches(nSteps, steps, playhead, mutes, selected);
+  ok &= check("nothing changed", frame(display, nSteps), -1);
+
+  printf("%2u step page     %4u frames, playhead move %d pixels  %s\n", nSteps, frames, worst, ok ? "ok" : "WRONG");
+  return ok ? worst : 0;
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--dump")) { dump = true; }
+  }
+  hostFrameHandler = frameH;
+
+  frames = 0;
+  int small = run(16);
+  frames = 0;
+  int large = run(64);
+
+  bool ok = small && large && small == large;
+  if (small && large && small != large) { printf("64 step page costs %d pixels a move, 16 step page %d\n", large, small); }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+/*
+ * Input to output latency of the whole sketch. Runs erhythms.ino on virtual time, presses
+ * channel 0's mute button and turns the length encoder at random moments (with contact
+ * bounce, at random tempos) and times each input edge to
+ *   handler: the sequencer state changing
+ *   output:  the first USB MIDI step that plays differently because of it
+ * Mutes show on the next step, length changes only where the bar wraps differently, so
+ * both output figures include the musical wait. Exits non-zero when a p99 or max is over
+ * its budget, or an input never reached the output.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. -x c++ sim/latency.cpp -o latency && ./latency
+ *
+ * Options: --trials N, --seed S, --loop-us U (virtual cost of one loop()), --cpu-scale X
+ * (charge each loop() its host run time times X instead, to catch slow handlers).
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "erhythms.ino"
+
+// setup
+#define MUTE_PIN 5              // CHANNELBTN_PINS[0]
+#define PLAY_PIN 18             // GENERALBTN_PINS[0]
+#define ENCODER_PIN 26          // ENCODER_PINS[0][0]
+#define MUTE_CHANNEL 0          // plays every step
+#define REF_CHANNEL 1           // plays every step, marks the steps
+#define BAR_CHANNEL 2           // plays the first step of the bar
+#define START_LENGTH 8
+#define MIN_BPM 120
+#define MAX_BPM 180
+#define STEP_MATCH_US 3000      // notes this close to a reference note belong to its step
+
+// budgets, ms
+#define MUTE_HANDLER_P99 20
+#define MUTE_HANDLER_MAX 25
+#define MUTE_OUTPUT_P99 520
+#define MUTE_OUTPUT_MAX 540
+#define LENGTH_HANDLER_P99 5
+#define LENGTH_HANDLER_MAX 5
+#define LENGTH_OUTPUT_P99 5500     // mostly waiting for the bar to wrap, up to a bar and a bit
+#define LENGTH_OUTPUT_MAX 6000
+
+struct PinEvent {
+  uint32_t at;
+  uint8_t pin;
+  int8_t level;           // pin level, or encoder counts to add when encoder is set
+  bool encoder;
+};
+
+struct Trial {
+  bool length;            // length turn, mute press otherwise
+  uint32_t edge;
+  uint32_t handled;
+  uint8_t before;         // length or mute before the input
+};
+
+struct Note {
+  uint32_t at;
+  uint8_t channel;
+};
+
+static std::vector<PinEvent> events;
+static std::vector<Note> notes;
+static uint32_t rng = 1;
+
+static uint32_t rnd(uint32_t lo, uint32_t hi) {
+  rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+  return lo + rng % (hi - lo + 1);
+}
+
+static void outputH(uint8_t port, const uint8_t* data, uint8_t len) {
+  if (port != PORT_USB || len != 3 || (data[0] & 0xF0) != MIDI_NOTE_ON || !data[2]) { return; }
+  notes.push_back({ hostMicros, (uint8_t)(data[1] - DEFAULT_NOTE) });
+}
+
+/**
+ * A press or release: the first edge, then a few bounces before the contact settles
+ */
+static void bounce(uint32_t at, uint8_t pin, int8_t level) {
+  events.push_back({ at, pin, level, false });
+  uint8_t n = rnd(0, 3);
+  for (uint8_t k = 0; k < n; k++) {
+    at += rnd(100, 700);
+    events.push_back({ at, pin, (int8_t)!level, false });
+    at += rnd(100, 700);
+    events.push_back({ at, pin, level, false });
+  }
+}
+
+static uint32_t percentile(std::vector<uint32_t> v, double p) {
+  if (v.empty()) { return 0; }
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static bool report(const char* name, const std::vector<uint32_t>& us, uint32_t p99Budget, uint32_t maxBudget) {
+  uint32_t p50 = percentile(us, 0.50), p99 = percentile(us, 0.99), max = percentile(us, 1.0);
+  bool ok = p99 <= p99Budget * 1000 && max <= maxBudget * 1000;
+  printf("%-15s %5zu  p50 %8.2f  p99 %8.2f  max %8.2f ms   budget p99 %5u max %5u  %s\n", name, us.size(),
+    p50 / 1000.0, p99 / 1000.0, max / 1000.0, p99Budget, maxBudget, ok ? "ok" : "OVER");
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  unsigned trials = 300;
+  unsigned loopUs = 25;
+  double cpuScale = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--trials")) { trials = atoi(argv[i + 1]); }
+    else if (!strcmp(argv[i], "--seed")) { rng = strtoul(argv[i + 1], NULL, 0) | 1; }
+    else if (!strcmp(argv[i], "--loop-us")) { loopUs = atoi(argv[i + 1]); }
+    else if (!strcmp(argv[i], "--cpu-scale")) { cpuScale = atof(argv[i + 1]); }
+  }
+
+  setup();
+  hostOutputHandler = outputH;
+  for (uint8_t i = 0; i < seq.nChannels; i++) { seq.channels[i].changeSequence((uint64_t)0, 64, START_LENGTH); }
+  seq.channels[MUTE_CHANNEL].changeSequence(~0ull, 64, START_LENGTH);
+  seq.channels[REF_CHANNEL].changeSequence(~0ull, 64, START_LENGTH);
+  seq.channels[BAR_CHANNEL].changeSequence(1ull, 64, START_LENGTH);
+
+  // press play, then one trial at a time
+  bounce(10000, PLAY_PIN, LOW);
+  bounce(90000, PLAY_PIN, HIGH);
+  std::vector<Trial> done;
+  Trial trial = {};
+  bool pending = false;
+  uint32_t nextTrial = 1000000;
+  int8_t turn = 2;
+  size_t next = 0;
+
+  while (done.size() < trials) {
+    if (!pending && hostMicros >= nextTrial) {
+      float bpm = rnd(MIN_BPM * 10, MAX_BPM * 10) / 10.0f;
+      seq.setTempo(bpm);
+      uint32_t stepUs = 60000000 / bpm;
+      trial = {};
+      trial.length = rnd(0, 1);
+      trial.edge = hostMicros + rnd(0, stepUs);
+      if (trial.length) {
+        trial.before = seq.getLength();
+        events.push_back({ trial.edge, ENCODER_PIN, (int8_t)(turn / 2), true });
+        events.push_back({ trial.edge + rnd(1000, 4000), ENCODER_PIN, (int8_t)(turn / 2), true });
+        turn = -turn;
+        nextTrial = trial.edge + 2 * START_LENGTH * stepUs + stepUs;
+      } else {
+        trial.before = seq.channels[MUTE_CHANNEL].isMuted();
+        uint32_t hold = rnd(60000, 250000);
+        bounce(trial.edge, MUTE_PIN, LOW);
+        bounce(trial.edge + hold, MUTE_PIN, HIGH);
+        nextTrial = trial.edge + hold + 2 * stepUs;
+      }
+      std::sort(events.begin() + next, events.end(), [](const PinEvent& a, const PinEvent& b) { return a.at < b.at; });
+      pending = true;
+    }
+
+    for (; next < events.size() && events[next].at <= hostMicros; next++) {
+      PinEvent& e = events[next];
+      if (e.encoder) { hostEncoderCounts[e.pin] += e.level; }
+      else { hostPins[e.pin] = e.level; }
+    }
+
+    if (cpuScale > 0) {
+      auto t0 = std::chrono::steady_clock::now();
+      loop();
+      double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+      hostMicros += std::max((uint32_t)(ns * cpuScale / 1000), 1u);
+    } else {
+      loop();
+      hostMicros += loopUs;
+    }
+
+    if (pending && !trial.handled && hostMicros >= trial.edge) {
+      bool moved = trial.length ? seq.getLength() != trial.before
+                                : seq.channels[MUTE_CHANNEL].isMuted() != trial.before;
+      if (moved) { trial.handled = hostMicros; }
+    }
+    if (pending && hostMicros >= nextTrial) {
+      done.push_back(trial);
+      pending = false;
+    }
+  }
+
+  // steps as the reference channel played them, and what the others did on each
+  std::vector<uint32_t> stepAt;
+  for (Note& n : notes) { if (n.channel == REF_CHANNEL) { stepAt.push_back(n.at); } }
+  std::vector<uint8_t> played(stepAt.size(), 0);
+  for (Note& n : notes) {
+    auto it = std::lower_bound(stepAt.begin(), stepAt.end(), n.at - STEP_MATCH_US);
+    if (it != stepAt.end() && *it <= n.at + STEP_MATCH_US) { played[it - stepAt.begin()] |= 1 << n.channel; }
+  }
+
+  std::vector<uint32_t> muteHandler, muteOutput, lengthHandler, lengthOutput;
+  unsigned lost = 0;
+  for (Trial& t : done) {
+    if (!t.handled) { lost++; continue; }
+    size_t first = std::lower_bound(stepAt.begin(), stepAt.end(), t.edge) - stepAt.begin();
+    size_t changed = stepAt.size();
+    if (!t.length) {
+      // first step the channel plays as the new mute says
+      for (size_t j = first; j < stepAt.size(); j++) {
+        if ((bool)(played[j] & (1 << MUTE_CHANNEL)) == (bool)t.before) { changed = j; break; }
+      }
+    } else {
+      // first step that breaks the old bar length
+      size_t bar = first;
+      while (bar > 0 && !(played[bar - 1] & (1 << BAR_CHANNEL))) { bar--; }
+      if (bar > 0) {
+        bar--;
+        for (size_t j = first; j < stepAt.size(); j++) {
+          bool expected = (j - bar) % t.before == 0;
+          if ((bool)(played[j] & (1 << BAR_CHANNEL)) != expected) { changed = j; break; }
+        }
+      }
+    }
+    if (changed == stepAt.size()) { lost++; continue; }
+    (t.length ? lengthHandler : muteHandler).push_back(t.handled - t.edge);
+    (t.length ? lengthOutput : muteOutput).push_back(stepAt[changed] - t.edge);
+  }
+
+  if (cpuScale > 0) { printf("%u trials, %zu steps, loop() charged %.0fx its host time\n", trials, stepAt.size(), cpuScale); }
+  else { printf("%u trials, %zu steps, %u us per loop\n", trials, stepAt.size(), loopUs); }
+  bool ok = true;
+  ok &= report("mute handler", muteHandler, MUTE_HANDLER_P99, MUTE_HANDLER_MAX);
+  ok &= report("mute output", muteOutput, MUTE_OUTPUT_P99, MUTE_OUTPUT_MAX);
+  ok &= report("length handler", lengthHandler, LENGTH_HANDLER_P99, LENGTH_HANDLER_MAX);
+  ok &= report("length output", lengthOutput, LENGTH_OUTPUT_P99, LENGTH_OUTPUT_MAX);
+  if (lost) { printf("%u inputs never reached the output\n", lost); ok = false; }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+/*
+ * Control link loopback: pushes a full 16 channel reload (state, chances, lanes, a preset bank)
+ * through ControlLink as the laptop would, reads the state back and checks it, checks that
+ * out of range presets are refused, then times the parser. Exits non-zero when anything does
+ * not round trip.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. sim/link_loopback.cpp -o link_loopback && ./link_loopback
+ */
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include "sequencer.h"
+#include "protocol.h"
+
+#define USB_CDC_BYTES_PER_S 1000000.0     // what full speed CDC sustains in practice
+#define ITERATIONS 2000
+
+static std::vector<uint8_t> rxStream;
+
+static void linkH(const uint8_t* data, uint16_t n) { rxStream.insert(rxStream.end(), data, data + n); }
+
+/**
+ * Frame a command the way the laptop does
+ */
+static void frame(std::vector<uint8_t>& out, uint8_t cmd, uint8_t tag, const uint8_t* payload, uint16_t n) {
+  uint8_t raw[LINK_MAX_FRAME];
+  uint8_t enc[LINK_MAX_FRAME + LINK_MAX_FRAME / 254 + 1];
+  raw[0] = cmd;
+  raw[1] = tag;
+  memcpy(raw + 2, payload, n);
+  uint16_t crc = crc16(raw, n + 2);
+  raw[n + 2] = crc;
+  raw[n + 3] = crc >> 8;
+  uint16_t length = cobsEncode(raw, n + 4, enc);
+  out.insert(out.end(), enc, enc + length);
+  out.push_back(0);
+}
+
+/**
+ * Split the replies into decoded frames, dropping ones that fail their CRC
+ */
+static std::vector<std::vector<uint8_t>> replies() {
+  std::vector<std::vector<uint8_t>> frames;
+  std::vector<uint8_t> cur;
+  for (size_t i = 0; i < rxStream.size(); i++) {
+    if (rxStream[i] == 0) {
+      if (cur.size() >= 4 && crc16(cur.data(), cur.size() - 2) == (cur[cur.size() - 2] | (cur[cur.size() - 1] << 8))) {
+        cur.resize(cur.size() - 2);
+        frames.push_back(cur);
+      }
+      cur.clear();
+      continue;
+    }
+    uint8_t code = rxStream[i];
+    for (uint8_t k = 1; k < code && i + 1 < rxStream.size(); k++) { cur.push_back(rxStream[++i]); }
+    if (code != 0xFF && i + 1 < rxStream.size() && rxStream[i + 1] != 0) { cur.push_back(0); }
+  }
+  rxStream.clear();
+  return frames;
+}
+
+int main() {
+  MIDISequencer seq(MAX_CHANNELS);
+  static ControlLink link(seq);
+  hostLinkHandler = linkH;
+  int failures = 0;
+
+  // a full reload
+  uint32_t rng = 12345;
+  auto next = [&rng]() { rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5; return rng; };
+
+  std::vector<uint8_t> reload;
+  uint8_t state[STATE_HEADER + MAX_CHANNELS * STATE_CHANNEL];
+  state[0] = 13000 & 0xFF; state[1] = 13000 >> 8; state[2] = 0; state[3] = MAX_CHANNELS;
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+    uint8_t* c = state + STATE_HEADER + i * STATE_CHANNEL;
+    c[0] = 1 + next() % MAX_SEQLENGTH;
+    c[1] = i & 1;
+    uint64_t sequence = (((uint64_t)next() << 32) | next()) & Channel::lengthMask(c[0]);
+    for (uint8_t b = 0; b < 8; b++) { c[2 + b] = sequence >> (b * 8); }
+  }
+  frame(reload, LINK_SET_STATE, 1, state, sizeof(state));
+
+  uint8_t chances[MAX_CHANNELS][2 + MAX_SEQLENGTH];
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+    chances[i][0] = i; chances[i][1] = 0;
+    for (uint8_t s = 0; s < MAX_SEQLENGTH; s++) { chances[i][2 + s] = next(); }
+    frame(reload, LINK_SET_CHANCE, 2 + i, chances[i], sizeof(chances[i]));
+  }
+
+  uint8_t lanes[MAX_CHANNELS][1 + STATE_LANES];
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+    uint8_t* l = lanes[i];
+    l[0] = i;
+    l[1] = next() % 128;
+    l[2] = next() % 128;
+    uint64_t accents = (((uint64_t)next() << 32) | next()) & Channel::lengthMask(state[STATE_HEADER + i * STATE_CHANNEL]);
+    for (uint8_t b = 0; b < 8; b++) { l[3 + b] = accents >> (b * 8); }
+    for (uint8_t b = 0; b < MAX_SEQLENGTH / 2; b++) { l[11 + b] = next(); }
+    frame(reload, LINK_SET_LANES, 40 + i, l, sizeof(lanes[i]));
+  }
+
+  // valid presets, the last one with pulses and rotation over its lengths, which come back clamped
+  uint8_t presets[PRESET_SLOTS][1 + sizeof(Scene)];
+  uint8_t expected[PRESET_SLOTS][1 + sizeof(Scene)];
+  for (uint8_t k = 0; k < PRESET_SLOTS; k++) {
+    Scene sc;
+    sc.tempo = k & 1 ? 0 : MIN_TEMPO * 100 + next() % ((MAX_TEMPO - MIN_TEMPO) * 100 + 1);
+    sc.mutes = next();
+    sc.barLength = next();
+    sc.repeats = next();
+    for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+      SceneChannel& c = sc.channels[i];
+      c.length = 1 + next() % MAX_SEQLENGTH;
+      c.pulses = next() % (c.length + 1);
+      c.rotation = next() % c.length;
+    }
+    presets[k][0] = k;
+    memcpy(presets[k] + 1, &sc, sizeof(Scene));
+    if (k == PRESET_SLOTS - 1) {
+      for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+        sc.channels[i].rotation += sc.channels[i].length;
+        sc.channels[i].pulses = sc.channels[i].length + 1 + next() % 100;
+      }
+      memcpy(presets[k] + 1, &sc, sizeof(Scene));
+      for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+        sc.channels[i].rotation -= sc.channels[i].length;
+        sc.channels[i].pulses = sc.channels[i].length;
+      }
+    }
+    expected[k][0] = k;
+    memcpy(expected[k] + 1, &sc, sizeof(Scene));
+    frame(reload, LINK_PUT_PRESET, 20 + k, presets[k], sizeof(presets[k]));
+  }
+  size_t reloadFrames = 1 + 2 * MAX_CHANNELS + PRESET_SLOTS;
+
+  // send it and check every command was acked
+  link.receive(reload.data(), reload.size());
+  std::vector<std::vector<uint8_t>> acks = replies();
+  size_t acked = 0;
+  for (auto& r : acks) { acked += (r[0] & LINK_REPLY) && r[0] != LINK_ERROR; }
+  if (acked != reloadFrames) { printf("FAIL %zu of %zu commands acked\n", acked, reloadFrames); failures++; }
+
+  // read it back
+  std::vector<uint8_t> query;
+  frame(query, LINK_GET_STATE, 100, NULL, 0);
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) { frame(query, LINK_GET_CHANCE, 101 + i, &i, 1); }
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) { frame(query, LINK_GET_LANES, 140 + i, &i, 1); }
+  for (uint8_t k = 0; k < PRESET_SLOTS; k++) { frame(query, LINK_GET_PRESET, 120 + k, &k, 1); }
+  link.receive(query.data(), query.size());
+  std::vector<std::vector<uint8_t>> back = replies();
+  if (back.size() != reloadFrames) {
+    printf("FAIL %zu replies to %zu queries\n", back.size(), reloadFrames);
+    failures++;
+  } else {
+    if (memcmp(back[0].data() + 2, state, sizeof(state))) { printf("FAIL state differs\n"); failures++; }
+    for (uint8_t i = 0; i < MAX_CHANNELS; i++) {
+      if (memcmp(back[1 + i].data() + 3, chances[i] + 2, MAX_SEQLENGTH)) { printf("FAIL chances of %u differ\n", i); failures++; }
+      if (memcmp(back[1 + MAX_CHANNELS + i].data() + 2, lanes[i], sizeof(lanes[i]))) { printf("FAIL lanes of %u differ\n", i); failures++; }
+    }
+    for (uint8_t k = 0; k < PRESET_SLOTS; k++) {
+      if (memcmp(back[1 + 2 * MAX_CHANNELS + k].data() + 2, expected[k], sizeof(expected[k]))) { printf("FAIL preset %u differs\n", k); failures++; }
+    }
+  }
+
+  // out of range presets are refused and leave the slot alone
+  const char* badNames[] = { "length 0", "length 200", "tempo 1 BPM" };
+  for (uint8_t b = 0; b < 3; b++) {
+    uint8_t preset[1 + sizeof(Scene)];
+    memcpy(preset, expected[0], sizeof(preset));
+    Scene* sc = (Scene*)(preset + 1);
+    if (b == 0) { sc->channels[3].length = 0; }
+    if (b == 1) { sc->channels[MAX_CHANNELS - 1].length = 200; }
+    if (b == 2) { sc->tempo = 100; }
+    std::vector<uint8_t> put;
+    frame(put, LINK_PUT_PRESET, 150 + b, preset, sizeof(preset));
+    uint8_t slot = 0;
+    frame(put, LINK_GET_PRESET, 160 + b, &slot, 1);
+    link.receive(put.data(), put.size());
+    std::vector<std::vector<uint8_t>> r = replies();
+    if (r.size() != 2 || r[0][0] != LINK_ERROR || r[0][2] != LINK_PUT_PRESET || r[0][3] != LINK_ERR_RANGE) {
+      printf("FAIL preset with %s not refused\n", badNames[b]);
+      failures++;
+    } else if (memcmp(r[1].data() + 2, expected[0], sizeof(expected[0]))) {
+      printf("FAIL preset with %s changed the slot\n", badNames[b]);
+      failures++;
+    }
+  }
+
+  // a corrupted frame is refused and the one after it still parses
+  std::vector<uint8_t> bad;
+  frame(bad, LINK_PING, 200, NULL, 0);
+  bad[2] ^= 0x40;
+  frame(bad, LINK_PING, 201, NULL, 0);
+  link.receive(bad.data(), bad.size());
+  std::vector<std::vector<uint8_t>> pings = replies();
+  if (pings.size() != 2 || pings[0][0] != LINK_ERROR || pings[0][3] != LINK_ERR_CRC || pings[1][0] != (LINK_PING | LINK_REPLY)) {
+    printf("FAIL corrupted frame not recovered from\n");
+    failures++;
+  }
+
+  // throughput of the parser, replies included
+  hostLinkHandler = NULL;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int n = 0; n < ITERATIONS; n++) { link.receive(reload.data(), reload.size()); }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  printf("reload: %zu frames, %zu bytes\n", reloadFrames, reload.size());
+  printf("parse:  %.1f MB/s, %.1f us per reload\n", reload.size() * ITERATIONS / s / 1e6, s / ITERATIONS * 1e6);
+  printf("wire:   %.2f ms per reload at %.0f kB/s\n", reload.size() / USB_CDC_BYTES_PER_S * 1000, USB_CDC_BYTES_PER_S / 1000);
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+// Host stand-in for PioEncoder: the count of the encoder on a pin is whatever a harness
+// writes to hostEncoderCounts.
+#pragma once
+#include <Arduino.h>
+
+inline int hostEncoderCounts[64] = {};
+
+class PioEncoder {
+  public:
+    PioEncoder(byte pin): pin(pin) {}
+
+    void begin() {}
+    int getCount() { return hostEncoderCounts[pin & 63]; }
+    void reset() { hostEncoderCounts[pin & 63] = 0; }
+
+  private:
+    byte pin;
+};
@@ -0,0 +1,212 @@
+/*
+ * Tempo changes: runs the clock on virtual time and checks that setTempo() keeps the phase of
+ * the pulse under way and the beat count, and that linear and exponential ramps move the
+ * tempo in even steps all the way to the target, without a jump on the last pulse. Also
+ * plays songs whose scenes are shorter than the lookahead and checks every step runs at its
+ * scene's tempo. Exits non-zero when a check fails.
+ *
+ *   cd firmware && g++ -std=c++17 -O2 -Isim -I. sim/tempo_ramp.cpp -o tempo_ramp && ./tempo_ramp
+ *
+ * Options: --seed S.
+ */
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+#include "sequencer.h"
+
+// setup
+#define RAMP_FROM 120.0
+#define RAMP_TO 180.0
+#define RAMP_STEP_US 50         // virtual time per update() while ramping
+#define PHASE_TRIALS 50
+#define SCENE_BPM_A 120
+#define SCENE_BPM_B 150
+#define SCENE_A_STEPS 4
+#define SCENE_LOOPS 4           // times the song goes round
+
+// budgets
+#define PHASE_US 2              // first pulse after setTempo() from where the phase puts it
+#define PERIOD_US 2             // pulses after it from the new period, us rounding included
+#define RAMP_MID_BPM 0.05       // tempo halfway through a ramp from the ideal curve
+#define RAMP_JUMP 1.5           // largest step between pulses, times the ideal one
+#define RAMP_JUMP_BPM 0.001     // plus this for rounding
+#define RAMP_TIME 0.001         // ramp length off the ideal curve's, relative
+#define SCENE_STEP_US 100       // step length off its scene's tempo
+
+static Clock* current;
+static std::vector<uint32_t> pulseAt;
+static std::vector<double> pulseTempo;
+static std::vector<uint32_t> stepAt;
+static uint32_t rng = 1;
+
+static uint32_t rnd(uint32_t lo, uint32_t hi) {
+  rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+  return lo + rng % (hi - lo + 1);
+}
+
+static void beatH(uint8_t* pos, uint64_t* allSequences, uint8_t nChannels, uint8_t seqLength, uint16_t beatnum) {
+  stepAt.push_back(hostMicros);
+}
+
+static void pulseH() {
+  pulseAt.push_back(hostMicros);
+  pulseTempo.push_back(current->getTempo());
+}
+
+/**
+ * Pulse length in 1/256 us, worked out the way the clock does
+ */
+static double fixedPeriod(float bpm) {
+  uint32_t tempo = (uint32_t)(bpm * TEMPO_ONE + 0.5f);
+  return (double)(uint32_t)((60000000ull << 24) / ((uint64_t)tempo * CLOCK_PPQN)) / 256;
+}
+
+static void run(Clock& clock, uint32_t until, uint32_t stepUs) {
+  while ((int32_t)(hostMicros - until) < 0) {
+    hostMicros += stepUs;
+    clock.update();
+  }
+}
+
+/**
+ * setTempo() half way through a pulse: the rest of the pulse stretches to the new period
+ */
+static bool phase() {
+  unsigned bad = 0;
+  double worstPhase = 0, worstPeriod = 0;
+  for (unsigned t = 0; t < PHASE_TRIALS; t++) {
+    Clock clock;
+    current = &clock;
+    clock.setPulseHandler(pulseH);
+    float from = rnd(MIN_TEMPO * 10, MAX_TEMPO * 10) / 10.0f;
+    float to = rnd(MIN_TEMPO * 10, MAX_TEMPO * 10) / 10.0f;
+    double oldPeriod = fixedPeriod(from);
+    double newPeriod = fixedPeriod(to);
+    clock.setTempo(from);
+    uint32_t startAt = hostMicros;
+    clock.start();
+    pulseAt.clear();
+    run(clock, hostMicros + rnd(3, 40) * oldPeriod + rnd(0, oldPeriod - 1), 1);
+
+    // where the pulse under way was due, and where it is due at the new tempo
+    uint32_t beat = clock.getBeat();
+    size_t before = pulseAt.size();
+    uint32_t now = hostMicros;
+    double due = startAt + (before + 1) * oldPeriod;
+    double expected = now + (due - now) * newPeriod / oldPeriod;
+    clock.setTempo(to);
+    if (clock.getBeat() != beat) { bad++; }
+    run(clock, expected + 4 * newPeriod, 1);
+    clock.stop();
+
+    double off = fabs(pulseAt[before] - expected);
+    if (off > worstPhase) { worstPhase = off; }
+    if (off > PHASE_US) { bad++; }
+    for (size_t k = before + 1; k < pulseAt.size(); k++) {
+      double p = fabs((pulseAt[k] - pulseAt[k - 1]) - newPeriod);
+      if (p > worstPeriod) { worstPeriod = p; }
+      if (p > PERIOD_US) { bad++; }
+    }
+  }
+  printf("setTempo phase    %u trials, first pulse off %.1f us, periods off %.1f us  %s\n",
+    PHASE_TRIALS, worstPhase, worstPeriod, bad ? "WRONG" : "ok");
+  return !bad;
+}
+
+/**
+ * A ramp over the given beats, checked pulse by pulse against the ideal curve
+ */
+static bool ramp(uint8_t shape, uint16_t beats) {
+  Clock clock;
+  current = &clock;
+  clock.setPulseHandler(pulseH);
+  clock.setTempo(RAMP_FROM);
+  clock.start();
+  run(clock, hostMicros + 100000, RAMP_STEP_US);
+  pulseTempo.clear();
+  pulseAt.clear();
+  clock.rampTempo(RAMP_TO, beats, shape);
+  uint32_t ticks = (uint32_t)beats * CLOCK_PPQN;
+  while (pulseTempo.size() < ticks + 4) { run(clock, hostMicros + 1000, RAMP_STEP_US); }
+  clock.stop();
+
+  // pulseTempo[k] is the tempo after k steps of the ramp
+  double idealStep = shape == RAMP_EXPONENTIAL ? RAMP_TO * (pow(RAMP_TO / RAMP_FROM, 1.0 / ticks) - 1)
+                                               : (RAMP_TO - RAMP_FROM) / ticks;
+  double mid = shape == RAMP_EXPONENTIAL ? sqrt(RAMP_FROM * RAMP_TO) : (RAMP_FROM + RAMP_TO) / 2;
+  double jump = 0;
+  for (size_t k = 1; k < pulseTempo.size(); k++) {
+    double d = fabs(pulseTempo[k] - pulseTempo[k - 1]);
+    if (d > jump) { jump = d; }
+  }
+  double midOff = fabs(pulseTempo[ticks / 2] - mid);
+
+  // the periods follow the tempo: time the whole ramp against the ideal curve
+  double ideal = 0;
+  for (uint32_t k = 0; k < ticks; k++) {
+    double bpm = shape == RAMP_EXPONENTIAL ? RAMP_FROM * pow(RAMP_TO / RAMP_FROM, (double)k / ticks)
+                                           : RAMP_FROM + (RAMP_TO - RAMP_FROM) * k / ticks;
+    ideal += 60e6 / (bpm * CLOCK_PPQN);
+  }
+  double timeOff = fabs((pulseAt[ticks] - pulseAt[0]) / ideal - 1);
+  double last = pulseTempo[ticks - 1];
+  bool ok = midOff <= RAMP_MID_BPM && timeOff <= RAMP_TIME && jump <= idealStep * RAMP_JUMP + RAMP_JUMP_BPM && pulseTempo.back() == (float)RAMP_TO;
+  printf("%-11s %4u beats  halfway %.3f off, before the end %8.3f, largest step %.4f (ideal %.4f) BPM, length %.4f%% off  %s\n",
+    shape == RAMP_EXPONENTIAL ? "exponential" : "linear", beats, midOff, last, jump, idealStep, timeOff * 100, ok ? "ok" : "WRONG");
+  return ok;
+}
+
+/**
+ * A song of a scene at SCENE_BPM_A and one of the given steps at SCENE_BPM_B: every step
+ * lasts as long as its scene's tempo says, however short the scene
+ */
+static bool scenes(uint8_t steps, uint8_t lookahead) {
+  Scene song[2] = {};
+  song[0].tempo = SCENE_BPM_A * 100;
+  song[0].barLength = SCENE_A_STEPS;
+  song[0].repeats = 1;
+  song[1].tempo = SCENE_BPM_B * 100;
+  song[1].barLength = steps;
+  song[1].repeats = 1;
+  for (uint8_t i = 0; i < MAX_CHANNELS; i++) { song[0].channels[i] = song[1].channels[i] = { 4, 4, 0 }; }
+
+  MIDISequencer seq(2);
+  seq.setLookahead(lookahead);
+  seq.setBeatHandler(beatH);
+  seq.playSong(song, 2);
+  stepAt.clear();
+  seq.start();
+  unsigned cycle = SCENE_A_STEPS + steps;
+  while (stepAt.size() < SCENE_LOOPS * cycle + 1) {
+    hostMicros += 25;
+    seq.update();
+  }
+  seq.stop();
+
+  unsigned wrong = 0;
+  for (size_t k = 0; k + 1 < stepAt.size(); k++) {
+    double bpm = k % cycle < SCENE_A_STEPS ? SCENE_BPM_A : SCENE_BPM_B;
+    if (fabs((stepAt[k + 1] - stepAt[k]) - 60e6 / bpm) > SCENE_STEP_US) { wrong++; }
+  }
+  printf("%u step scene at lookahead %u   %2u of %zu steps at the wrong tempo  %s\n",
+    steps, lookahead, wrong, stepAt.size() - 1, wrong ? "WRONG" : "ok");
+  return !wrong;
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--seed")) { rng = strtoul(argv[i + 1], NULL, 0) | 1; }
+  }
+  bool ok = phase();
+  uint16_t lengths[] = { 4, 64, 256, 1000 };
+  for (uint8_t shape = RAMP_LINEAR; shape <= RAMP_EXPONENTIAL; shape++) {
+    for (uint16_t beats : lengths) { ok &= ramp(shape, beats); }
+  }
+  uint8_t sceneSteps[] = { 1, 3, 6 };
+  for (uint8_t steps : sceneSteps) {
+    ok &= scenes(steps, DEFAULT_LOOKAHEAD);
+    ok &= scenes(steps, TIMELINE_SIZE / 2);
+  }
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}